@@ -0,0 +1,404 @@
+/*
+	ILBBENCH - Microbenchmarks for the ILB decoders, compositing and encoders
+
+	Runs every kernel over the records of real or synthetic libraries and
+	prints one JSON object per line:
+
+	{ "bench": "translate/rle16", "input": "s3", "iterations": 40, "seconds": 0.0021,
+	  "pixels": 1048576, "bytes": 524288, "pixels_per_s": 4.9e8, "mb_per_s": 249.6 }
+
+	seconds is the best time of one iteration. bytes is what the kernel
+	reads: record data for the decoders, RGBA for compositing and encoding
+	and the file for a whole conversion.
+*/
+
+#include <vector>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <getopt.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "synth.h"
+#include "../src/ilb.h"
+#include "../src/decode.h"
+#include "../src/arena.h"
+#include "../src/pngenc.h"
+#include "../src/imgenc.h"
+
+extern char **environ;
+
+struct BenchConfig
+{
+	// Keep repeating a benchmark until it has run this long
+	double minTime = 0.5;
+	unsigned threads = 1;
+	std::string filter;
+	std::string ilb2png;
+};
+
+// One layer ready to decode, with the arguments ilb2png would pass
+struct BenchLayer
+{
+	const IlbRecord *record;
+	PixelLayout layout;
+	size_t dataW;
+	size_t dataH;
+	size_t x;
+	size_t y;
+	uint32_t transparent;
+	uint32_t mode;
+	Palette palette;
+};
+
+static double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Times fn until minTime has passed and prints the best iteration
+static void bench(const BenchConfig &config, const std::string &name, const std::string &input, uint64_t pixels, uint64_t bytes, const std::function<void()> &fn)
+{
+	if (!config.filter.empty() && name.find(config.filter) == std::string::npos)
+		return;
+
+	if (!pixels)
+		return;
+
+	// One untimed run to warm caches and arenas
+	fn();
+
+	double best = 1e30;
+	double start = now();
+	unsigned iterations = 0;
+
+	do
+	{
+		double t = now();
+		fn();
+		best = std::min(best, now() - t);
+		iterations++;
+	} while (now() - start < config.minTime);
+
+	printf("{ \"bench\": \"%s\", \"input\": \"%s\", \"iterations\": %u, \"seconds\": %.6g, \"pixels\": %llu, \"bytes\": %llu, \"pixels_per_s\": %.4g, \"mb_per_s\": %.4g }\n",
+		name.c_str(), input.c_str(), iterations, best, (unsigned long long)pixels, (unsigned long long)bytes, pixels / best, bytes / best / 1e6);
+	fflush(stdout);
+}
+
+static bool benchLayer(const IlbFile &ilb, const IlbRecord &record, BenchLayer &layer)
+{
+	layer = { &record, LAYOUT_RAW16, record.clipW, record.clipH, record.clipX, record.clipY, record.trans, record.drawmode | (record.blendValue << 16), nullptr };
+
+	switch (record.type)
+	{
+	case 2:
+		layer.layout = LAYOUT_RLE8;
+		layer.palette = ilb.palette(record.colorset);
+		return layer.palette != nullptr;
+	case 16:
+		layer.dataW = record.width;
+		layer.dataH = record.height;
+		layer.x = record.xshift;
+		layer.y = record.yshift;
+		layer.transparent = 0xFFFFFFFF;
+		return record.colorset == ILB_PIXEL_565;
+	case 17:
+	case 18:
+		layer.layout = LAYOUT_RLE16;
+		return record.colorset == ILB_PIXEL_565;
+	case 22:
+		return record.colorset == ILB_PIXEL_565;
+	default:
+		return false;
+	}
+}
+
+static void decodeInto(const BenchLayer &layer, Image &canvas, bool over)
+{
+	const IlbRecord &r = *layer.record;
+
+	if (over)
+		translateOver(layer.layout, r.data, r.size, layer.dataW, layer.dataH, layer.x, layer.y, canvas.data, r.totalW, r.totalH, layer.transparent, layer.mode, layer.palette);
+	else
+		translate(layer.layout, r.data, r.size, layer.dataW, layer.dataH, layer.x, layer.y, canvas.data, r.totalW, r.totalH, layer.transparent, layer.mode, layer.palette);
+}
+
+static void benchFile(const BenchConfig &config, const std::filesystem::path &path)
+{
+	std::string input = path.stem().string();
+	IlbFile ilb;
+
+	if (!ilb.open(path))
+	{
+		std::cerr << "[ERR ] " << ilb.error() << std::endl;
+		return;
+	}
+
+	std::vector<IlbIndexEntry> index;
+	ilb.buildIndex(index);
+
+	std::vector<IlbImage> images(index.size());
+	std::vector<BenchLayer> layers;
+
+	for (size_t i = 0; i < index.size(); ++i)
+	{
+		size_t pos = index[i].offset;
+		ilb.readImage(pos, images[i]);
+	}
+
+	size_t maxCanvas = 0;
+	for (const IlbImage &image : images)
+	{
+		for (const IlbRecord &record : image.layers)
+		{
+			BenchLayer layer;
+			if (benchLayer(ilb, record, layer))
+			{
+				layers.push_back(layer);
+				maxCanvas = std::max<size_t>(maxCanvas, (size_t)record.totalW * record.totalH);
+			}
+		}
+	}
+
+	Image canvas(maxCanvas, 1);
+
+	// Every layout on its own, straight onto a canvas and blended over one
+	static const struct { PixelLayout layout; uint32_t type; const char *name; } kernels[] =
+	{
+		{ LAYOUT_RAW16, 16, "raw16" },
+		{ LAYOUT_RAW16, 22, "sprite16" },
+		{ LAYOUT_RLE16, 0,  "rle16" },
+		{ LAYOUT_RLE8,  0,  "rle8" }
+	};
+
+	for (const auto &kernel : kernels)
+	{
+		std::vector<const BenchLayer*> selected;
+		uint64_t pixels = 0;
+		uint64_t bytes = 0;
+
+		for (const BenchLayer &layer : layers)
+		{
+			if (layer.layout != kernel.layout || (kernel.type && layer.record->type != kernel.type))
+				continue;
+
+			selected.push_back(&layer);
+			pixels += (uint64_t)layer.dataW * layer.dataH;
+			bytes += layer.record->size;
+		}
+
+		for (bool over : { false, true })
+		{
+			bench(config, std::string(over ? "translateOver/" : "translate/") + kernel.name, input, pixels, bytes, [&]()
+			{
+				for (const BenchLayer *layer : selected)
+					decodeInto(*layer, canvas, over);
+			});
+		}
+	}
+
+	// Whole canvases of every first layer, and every other layer on its
+	// own canvas for compositing
+	std::vector<std::unique_ptr<Image>> canvases;
+	std::vector<std::pair<Image*, std::unique_ptr<Image>>> composites;
+	uint64_t canvasPixels = 0;
+	uint64_t compositePixels = 0;
+
+	for (const IlbImage &image : images)
+	{
+		Image *base = nullptr;
+
+		for (const IlbRecord &record : image.layers)
+		{
+			BenchLayer layer;
+			if (!benchLayer(ilb, record, layer))
+				continue;
+
+			auto decoded = std::make_unique<Image>(record.totalW, record.totalH);
+			decoded->xoff = record.xshift;
+			decoded->yoff = record.yshift;
+			decodeInto(layer, *decoded, false);
+
+			if (!base)
+			{
+				base = decoded.get();
+				canvasPixels += decoded->width * decoded->height;
+				canvases.push_back(std::move(decoded));
+			}
+			else
+			{
+				compositePixels += decoded->width * decoded->height;
+				composites.emplace_back(base, std::move(decoded));
+			}
+		}
+	}
+
+	bench(config, "composite", input, compositePixels, 4 * compositePixels, [&]()
+	{
+		for (auto &c : composites)
+			c.first->composite(*c.second);
+	});
+
+	Arena arena;
+
+	static const struct { PngPreset preset; const char *name; } presets[] =
+	{
+		{ PngPreset::Store,   "encode/png-store" },
+		{ PngPreset::Fast,    "encode/png-fast" },
+		{ PngPreset::Default, "encode/png-default" },
+		{ PngPreset::Max,     "encode/png-max" }
+	};
+
+	for (const auto &p : presets)
+	{
+		pngInit(p.preset);
+
+		bench(config, p.name, input, canvasPixels, 4 * canvasPixels, [&]()
+		{
+			for (const auto &image : canvases)
+			{
+				size_t size;
+				pngEncode(image->data, image->width, image->height, p.preset, PNG_FILTER_UP, arena, size);
+				arena.reset();
+			}
+		});
+	}
+
+	static const struct { OutputFormat format; const char *name; } formats[] =
+	{
+		{ OutputFormat::Qoi, "encode/qoi" },
+		{ OutputFormat::Tga, "encode/tga" },
+		{ OutputFormat::Pam, "encode/pam" }
+	};
+
+	for (const auto &f : formats)
+	{
+		std::unique_ptr<ImageEncoder> encoder = makeImageEncoder(f.format, PngPreset::Default);
+
+		bench(config, f.name, input, canvasPixels, 4 * canvasPixels, [&]()
+		{
+			for (const auto &image : canvases)
+			{
+				size_t size;
+				encoder->encode(*image, 16, arena, size);
+				arena.reset();
+			}
+		});
+	}
+
+	// The real thing, start to finish, as its own process
+	if (!config.ilb2png.empty())
+	{
+		std::filesystem::path outDir = std::filesystem::temp_directory_path() / ("ilbbench-" + std::to_string(getpid()));
+		std::string threads = std::to_string(config.threads);
+		std::string pathString = path.string();
+		std::string outString = outDir.string();
+
+		uint64_t pixels = 0;
+		for (const IlbIndexEntry &entry : index)
+			pixels += (uint64_t)entry.width * entry.height;
+
+		bench(config, "ilb2png/j" + threads, input, pixels, ilb.size(), [&]()
+		{
+			const char *argv[] = { config.ilb2png.c_str(), "-j", threads.c_str(), pathString.c_str(), outString.c_str(), nullptr };
+			posix_spawn_file_actions_t actions;
+			pid_t pid;
+			int status = 0;
+
+			posix_spawn_file_actions_init(&actions);
+			posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+			if (posix_spawn(&pid, argv[0], &actions, nullptr, const_cast<char**>(argv), environ) == 0)
+				waitpid(pid, &status, 0);
+
+			posix_spawn_file_actions_destroy(&actions);
+			std::filesystem::remove_all(outDir);
+		});
+	}
+}
+
+static void usage()
+{
+	std::cout << "Usage: ilbbench [options] [ilbfile...]" << std::endl;
+	std::cout << "  Without files, benchmarks a synthetic v3 and v4 library" << std::endl;
+	std::cout << "  --min-time <s>     run every benchmark at least this long (default 0.5)" << std::endl;
+	std::cout << "  --filter <text>    only run benchmarks whose name contains text" << std::endl;
+	std::cout << "  --ilb2png <path>   also time whole conversions with this ilb2png" << std::endl;
+	std::cout << "  -j <threads>       threads for those conversions (default 1)" << std::endl;
+}
+
+int main(int argc, char* *argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "min-time", required_argument, nullptr, 't' },
+		{ "filter",   required_argument, nullptr, 'f' },
+		{ "ilb2png",  required_argument, nullptr, 'x' },
+		{ "help",     no_argument,       nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	BenchConfig config;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hj:", longOptions, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			config.minTime = strtod(optarg, nullptr);
+			break;
+		case 'f':
+			config.filter = optarg;
+			break;
+		case 'x':
+			config.ilb2png = optarg;
+			break;
+		case 'j':
+			config.threads = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+
+	if (optind < argc)
+	{
+		for (int i = optind; i < argc; ++i)
+			benchFile(config, argv[i]);
+
+		return 0;
+	}
+
+	for (unsigned version : { 3, 4 })
+	{
+		SynthOptions options;
+		options.version = version;
+		options.composites = 0.2;
+
+		std::vector<uint8_t> data = synthIlb(options);
+		std::filesystem::path path = std::filesystem::temp_directory_path() / ("ilbbench-synth-v" + std::to_string(version) + ".ilb");
+
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0)
+		{
+			std::cerr << "[ERR ] Failed to write " << path.string() << std::endl;
+			return -2;
+		}
+
+		benchFile(config, path);
+		std::filesystem::remove(path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+	ILBGEN - Writes synthetic AoW1 ILB libraries for benchmarking
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+
+#include "synth.h"
+
+static void usage()
+{
+	std::cout << "Usage: ilbgen [options] <out.ilb>" << std::endl;
+	std::cout << "  --version <3|4>        inline pixel data or an image directory (default 3)" << std::endl;
+	std::cout << "  --types <list>         record types to use, e.g. 2,16,17,18,22 (default all)" << std::endl;
+	std::cout << "  --count <n>            number of images (default 200)" << std::endl;
+	std::cout << "  --size <min>-<max>     canvas width and height range (default 16-256)" << std::endl;
+	std::cout << "  --transparency <0..1>  share of sprite pixels that are transparent (default 0.4)" << std::endl;
+	std::cout << "  --composites <0..1>    share of images with extra layers (default 0.1)" << std::endl;
+	std::cout << "  --palettes <n>         number of palettes (default 1)" << std::endl;
+	std::cout << "  --seed <n>             random seed (default 1)" << std::endl;
+}
+
+int main(int argc, char* *argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "version",      required_argument, nullptr, 'v' },
+		{ "types",        required_argument, nullptr, 't' },
+		{ "count",        required_argument, nullptr, 'c' },
+		{ "size",         required_argument, nullptr, 's' },
+		{ "transparency", required_argument, nullptr, 'T' },
+		{ "composites",   required_argument, nullptr, 'C' },
+		{ "palettes",     required_argument, nullptr, 'p' },
+		{ "seed",         required_argument, nullptr, 'S' },
+		{ "help",         no_argument,       nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	SynthOptions options;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h", longOptions, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+		case 'v':
+			options.version = strtoul(optarg, nullptr, 0);
+			if (options.version != 3 && options.version != 4)
+			{
+				std::cerr << "[ERR ] Version must be 3 or 4" << std::endl;
+				return -1;
+			}
+			break;
+		case 't':
+			if (!synthParseTypes(optarg, options.types))
+			{
+				std::cerr << "[ERR ] Bad type list: " << optarg << std::endl;
+				return -1;
+			}
+			break;
+		case 'c':
+			options.count = strtoul(optarg, nullptr, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%zu-%zu", &options.minSize, &options.maxSize) != 2 || options.minSize < 1 || options.maxSize < options.minSize)
+			{
+				std::cerr << "[ERR ] Bad size range: " << optarg << std::endl;
+				return -1;
+			}
+			break;
+		case 'T':
+			options.transparency = strtod(optarg, nullptr);
+			break;
+		case 'C':
+			options.composites = strtod(optarg, nullptr);
+			break;
+		case 'p':
+			options.palettes = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		case 'S':
+			options.seed = strtoul(optarg, nullptr, 0);
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		usage();
+		return 0;
+	}
+
+	std::vector<uint8_t> ilb = synthIlb(options);
+
+	FILE *f = fopen(argv[optind], "wb");
+	if (!f || fwrite(ilb.data(), 1, ilb.size(), f) != ilb.size() || fclose(f) != 0)
+	{
+		std::cerr << "[ERR ] Failed to write " << argv[optind] << std::endl;
+		return -2;
+	}
+
+	std::cout << "Wrote " << options.count << " images, " << ilb.size() << " bytes to " << argv[optind] << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,474 @@
+/*
+	Synthetic ILB libraries for the benchmarks
+*/
+
+#include "synth.h"
+#include "../src/ilb.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace
+{
+	// Key colour of the 16 bit sprites, magenta, and palette index of the
+	// 8 bit ones
+	const uint32_t Key565 = 0xF81F;
+	const uint32_t KeyPal = 0;
+
+	class Writer
+	{
+	public:
+		std::vector<uint8_t> &out;
+
+		explicit Writer(std::vector<uint8_t> &out) : out(out) {}
+
+		void u8(uint8_t v) { out.push_back(v); }
+
+		void u16(uint16_t v)
+		{
+			out.push_back(v);
+			out.push_back(v >> 8);
+		}
+
+		void u32(uint32_t v)
+		{
+			u16(v);
+			u16(v >> 16);
+		}
+
+		void f32(float v)
+		{
+			uint32_t bits;
+			memcpy(&bits, &v, 4);
+			u32(bits);
+		}
+
+		void bytes(const void *data, size_t size)
+		{
+			const uint8_t *p = static_cast<const uint8_t*>(data);
+			out.insert(out.end(), p, p + size);
+		}
+
+		void patch32(size_t pos, uint32_t v)
+		{
+			for (int i = 0; i < 4; ++i)
+				out[pos + i] = v >> (8 * i);
+		}
+	};
+
+	class Generator
+	{
+	public:
+		Generator(const SynthOptions &options) : options(options), rng(options.seed) {}
+
+		std::vector<uint8_t> build();
+
+	private:
+		struct Layer
+		{
+			uint32_t type;
+			uint32_t totalW;
+			uint32_t totalH;
+			uint32_t xshift;
+			uint32_t yshift;
+		};
+
+		size_t range(size_t lo, size_t hi)
+		{
+			return std::uniform_int_distribution<size_t>(lo, hi)(rng);
+		}
+
+		bool chance(double p)
+		{
+			return std::uniform_real_distribution<double>(0, 1)(rng) < p;
+		}
+
+		// Which pixels of a w x h sprite show: runs of 1 to 48 pixels,
+		// each transparent with the configured chance
+		std::vector<bool> mask(size_t w, size_t h);
+
+		// Smooth gradient with a bit of noise, so it compresses like art
+		uint16_t pixel565(size_t x, size_t y, uint32_t salt);
+		uint8_t pixelPal(size_t x, size_t y, uint32_t salt);
+
+		std::vector<uint8_t> raw16(size_t w, size_t h, const std::vector<bool> *shown, uint32_t salt);
+		std::vector<uint8_t> rle16(size_t w, size_t h, const std::vector<bool> &shown, uint32_t salt);
+		std::vector<uint8_t> rle8(size_t w, size_t h, const std::vector<bool> &shown, uint32_t salt);
+
+		void record(Writer &list, std::vector<uint8_t> &directory, const Layer &layer, bool composite, uint32_t salt);
+
+		const SynthOptions &options;
+		std::mt19937 rng;
+	};
+
+	std::vector<bool> Generator::mask(size_t w, size_t h)
+	{
+		std::vector<bool> shown(w * h);
+
+		for (size_t y = 0; y < h; ++y)
+		{
+			for (size_t x = 0; x < w; )
+			{
+				size_t run = std::min(w - x, range(1, 48));
+				bool show = !chance(options.transparency);
+
+				for (size_t i = 0; i < run; ++i)
+					shown[y * w + x + i] = show;
+				x += run;
+			}
+		}
+
+		return shown;
+	}
+
+	uint16_t Generator::pixel565(size_t x, size_t y, uint32_t salt)
+	{
+		uint32_t r = (x / 4 + salt) & 31;
+		uint32_t g = (y / 2 + salt * 3 + (rng() & 3)) & 63;
+		uint32_t b = ((x + y) / 8 + salt * 7) & 31;
+		uint16_t v = r << 11 | g << 5 | b;
+
+		return v == Key565 ? v ^ 1 : v;
+	}
+
+	uint8_t Generator::pixelPal(size_t x, size_t y, uint32_t salt)
+	{
+		uint8_t v = (x / 3 + y / 5 + salt + (rng() & 1)) & 255;
+		return v == KeyPal ? 1 : v;
+	}
+
+	std::vector<uint8_t> Generator::raw16(size_t w, size_t h, const std::vector<bool> *shown, uint32_t salt)
+	{
+		std::vector<uint8_t> data;
+		Writer out(data);
+
+		for (size_t y = 0; y < h; ++y)
+			for (size_t x = 0; x < w; ++x)
+				out.u16(!shown || (*shown)[y * w + x] ? pixel565(x, y, salt) : Key565);
+
+		return data;
+	}
+
+	// Rows of 16 bit items behind their byte length as two words. A key
+	// pixel is followed by its run length in bytes, except as the last item
+	// of a row, where it stands for one pixel. Rows must come out at an even
+	// number of items.
+	std::vector<uint8_t> Generator::rle16(size_t w, size_t h, const std::vector<bool> &shown, uint32_t salt)
+	{
+		std::vector<uint8_t> data;
+		Writer out(data);
+		std::vector<uint16_t> items;
+
+		for (size_t y = 0; y < h; ++y)
+		{
+			items.clear();
+			bool lastTransparent = false;
+			size_t lastRun = 0;
+
+			for (size_t x = 0; x < w; )
+			{
+				size_t run = 0;
+				bool show = shown[y * w + x];
+
+				while (x + run < w && shown[y * w + x + run] == show && run < 16383)
+					run++;
+
+				if (show)
+				{
+					for (size_t i = 0; i < run; ++i)
+						items.push_back(pixel565(x + i, y, salt));
+				}
+				else
+				{
+					items.push_back(Key565);
+					items.push_back(2 * run);
+				}
+
+				lastTransparent = !show;
+				lastRun = run;
+				x += run;
+			}
+
+			if (items.size() & 1)
+			{
+				if (lastTransparent && lastRun > 1)
+				{
+					// Run one short, then a lone key for the last pixel
+					items.back() -= 2;
+					items.push_back(Key565);
+				}
+				else if (lastTransparent)
+				{
+					items.pop_back();
+				}
+				else
+				{
+					// The last pixel becomes a run of one
+					items.back() = Key565;
+					items.push_back(2);
+				}
+			}
+
+			out.u32(2 * (items.size() + 2));
+			for (uint16_t item : items)
+				out.u16(item);
+		}
+
+		return data;
+	}
+
+	// Rows of palette indices behind their byte length as one int. A key
+	// index is followed by its run length in pixels.
+	std::vector<uint8_t> Generator::rle8(size_t w, size_t h, const std::vector<bool> &shown, uint32_t salt)
+	{
+		std::vector<uint8_t> data;
+		Writer out(data);
+		std::vector<uint8_t> items;
+
+		for (size_t y = 0; y < h; ++y)
+		{
+			items.clear();
+
+			for (size_t x = 0; x < w; )
+			{
+				size_t run = 0;
+				bool show = shown[y * w + x];
+
+				while (x + run < w && shown[y * w + x + run] == show && run < 255)
+					run++;
+
+				if (show)
+				{
+					for (size_t i = 0; i < run; ++i)
+						items.push_back(pixelPal(x + i, y, salt));
+				}
+				else
+				{
+					items.push_back(KeyPal);
+					items.push_back(run);
+				}
+
+				x += run;
+			}
+
+			out.u32(items.size() + 4);
+			out.bytes(items.data(), items.size());
+		}
+
+		return data;
+	}
+
+	void Generator::record(Writer &list, std::vector<uint8_t> &directory, const Layer &layer, bool composite, uint32_t salt)
+	{
+		bool v4 = options.version == 4;
+		bool sprite = layer.type != 16;
+
+		// Sprites keep their pixels in a clip rectangle inside the canvas,
+		// pictures at their shift
+		size_t clipW = sprite ? range((layer.totalW + 1) / 2, layer.totalW) : 0;
+		size_t clipH = sprite ? range((layer.totalH + 1) / 2, layer.totalH) : 0;
+		size_t clipX = sprite ? range(0, layer.totalW - clipW) : 0;
+		size_t clipY = sprite ? range(0, layer.totalH - clipH) : 0;
+
+		std::vector<uint8_t> data;
+		std::vector<bool> shown;
+
+		if (sprite)
+			shown = mask(clipW, clipH);
+
+		switch (layer.type)
+		{
+		case 2:
+			data = rle8(clipW, clipH, shown, salt);
+			break;
+		case 16:
+			data = raw16(layer.totalW - layer.xshift, layer.totalH - layer.yshift, nullptr, salt);
+			break;
+		case 17:
+		case 18:
+			data = rle16(clipW, clipH, shown, salt);
+			break;
+		default:
+			data = raw16(clipW, clipH, &shown, salt);
+		}
+
+		if (composite)
+			list.u32(ILB_COMPOSITE);
+		list.u32(layer.type);
+
+		// v4 records may carry a draw mode; v3 ones need InfoByte 1 for
+		// inline data and so never do
+		uint8_t infoByte = v4 ? (chance(0.25) ? 3 : 2) : 1;
+		list.u8(infoByte);
+
+		char name[32];
+		snprintf(name, sizeof name, "Synth%u_%u", salt, layer.type);
+		list.u32(strlen(name));
+		list.bytes(name, strlen(name));
+
+		// A picture's pixels start at its shift inside the canvas, so the
+		// width is what is left of it
+		list.u32(sprite ? layer.totalW : layer.totalW - layer.xshift);
+		list.u32(sprite ? layer.totalH : layer.totalH - layer.yshift);
+		list.u32(layer.xshift);
+		list.u32(layer.yshift);
+		list.u32(0); // subID
+		list.u8(0);  // unknownA
+		list.u32(data.size());
+
+		if (infoByte != 1)
+			list.u32(directory.size());
+
+		list.u32(layer.totalW);
+		list.u32(layer.totalH);
+
+		if (layer.type == 2)
+			list.u8(0); // unknownB
+
+		if (infoByte == 3)
+		{
+			// Show mode 2 with one of the blend modes, or half see through
+			static const uint32_t modes[] = { 0x0001, 0x0102, 0x0202, 0x0302, 0x0402 };
+			list.u32(modes[range(0, 4)]);
+			list.u32(range(0, 100));
+		}
+
+		list.u32(layer.type == 2 ? range(0, options.palettes - 1) : ILB_PIXEL_565);
+
+		if (sprite)
+		{
+			list.u32(clipW);
+			list.u32(clipH);
+			list.u32(clipX);
+			list.u32(clipY);
+			list.u32(layer.type == 2 ? KeyPal : Key565);
+		}
+
+		if (layer.type == 2 || layer.type == 17 || layer.type == 18)
+			list.u32(0); // unknownE
+
+		if (infoByte == 1)
+			list.bytes(data.data(), data.size());
+		else
+			directory.insert(directory.end(), data.begin(), data.end());
+	}
+
+	std::vector<uint8_t> Generator::build()
+	{
+		std::vector<uint8_t> file;
+		std::vector<uint8_t> directory;
+		Writer out(file);
+		bool v4 = options.version == 4;
+
+		out.u32(ILB_MAGIC);
+		out.u32(options.seed);
+		out.f32(v4 ? 4.0f : 3.0f);
+		out.u32(v4 ? 24 : 16);
+
+		size_t directoryField = file.size();
+		if (v4)
+		{
+			out.u32(0);
+			out.u32(0);
+		}
+
+		out.u32(options.palettes);
+		for (unsigned p = 0; p < options.palettes; ++p)
+		{
+			out.u32(ILB_PALETTE_TYPE);
+			for (int i = 0; i < 256; ++i)
+			{
+				out.u8((i * 7 + p * 31) & 255);
+				out.u8((i * 3 + p * 17) & 255);
+				out.u8((255 - i + p * 11) & 255);
+				out.u8(0);
+			}
+		}
+
+		for (size_t n = 0; n < options.count; ++n)
+		{
+			uint32_t salt = n;
+			Layer base;
+
+			base.type = options.types[range(0, options.types.size() - 1)];
+			base.totalW = range(options.minSize, options.maxSize);
+			base.totalH = range(options.minSize, options.maxSize);
+			base.xshift = base.type == 16 ? range(0, base.totalW / 8) : 0;
+			base.yshift = base.type == 16 ? range(0, base.totalH / 8) : 0;
+
+			bool composite = chance(options.composites) && base.totalW >= 8 && base.totalH >= 8;
+
+			out.u32(1000 + n);
+			record(out, directory, base, composite, salt);
+
+			if (composite)
+			{
+				size_t layers = range(1, 3);
+
+				for (size_t l = 0; l < layers; ++l)
+				{
+					// Sprites that fit on the base at their shift
+					static const uint32_t spriteTypes[] = { 2, 17, 18, 22 };
+					Layer layer;
+
+					layer.type = spriteTypes[range(0, 3)];
+					layer.totalW = range(base.totalW / 4, base.totalW / 2);
+					layer.totalH = range(base.totalH / 4, base.totalH / 2);
+					layer.xshift = range(0, base.totalW - layer.totalW);
+					layer.yshift = range(0, base.totalH - layer.totalH);
+
+					record(out, directory, layer, true, salt + 1000 * (l + 1));
+				}
+
+				out.u32(ILB_COMPOSITE);
+				out.u32(0);
+			}
+
+			out.u32(ILB_END);
+		}
+
+		out.u32(ILB_END);
+
+		if (v4)
+		{
+			out.patch32(directoryField, file.size());
+			out.patch32(directoryField + 4, file.size() + directory.size());
+			file.insert(file.end(), directory.begin(), directory.end());
+		}
+
+		return file;
+	}
+}
+
+bool synthParseTypes(const char *list, std::vector<uint32_t> &types)
+{
+	types.clear();
+
+	const char *p = list;
+	while (*p)
+	{
+		char *end;
+		unsigned long type = strtoul(p, &end, 10);
+
+		if (end == p || !ilbKnownType(type))
+			return false;
+
+		types.push_back(type);
+
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return false;
+	}
+
+	return !types.empty();
+}
+
+std::vector<uint8_t> synthIlb(const SynthOptions &options)
+{
+	return Generator(options).build();
+}
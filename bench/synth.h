@@ -0,0 +1,37 @@
+/*
+	Synthetic ILB libraries for the benchmarks
+*/
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// What goes into a synthetic library
+struct SynthOptions
+{
+	// 3 keeps pixel data inline behind each record, 4 in an image directory
+	unsigned version = 3;
+	// Record types to draw from, evenly: 2, 16, 17, 18 or 22
+	std::vector<uint32_t> types = { 2, 16, 17, 18, 22 };
+	size_t count = 200;
+	// Canvas width and height range
+	size_t minSize = 16;
+	size_t maxSize = 256;
+	// Share of sprite pixels that are transparent, in runs
+	double transparency = 0.4;
+	// Share of images that get one to three extra sprite layers on top
+	double composites = 0.1;
+	unsigned palettes = 1;
+	uint32_t seed = 1;
+};
+
+// Parses a comma separated list of record types
+bool synthParseTypes(const char *list, std::vector<uint32_t> &types);
+
+// Builds a whole library in memory. IDs start at 1000 and count up.
+std::vector<uint8_t> synthIlb(const SynthOptions &options);
+
+#endif
@@ -3,171 +3,700 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <assert.h>
+#include <getopt.h>
 #include <errno.h>
 #include "progress.h"
+#include "sigscan.h"
 
-/* */
-static const unsigned char pattern[] = {
-   0x66, 0x8B, 0x16, 0x8D,
-   0x74, 0x16, 0x03, 0x81,
-   0xE6, 0xFC, 0xFF, 0xFF,
-   0x0F, 0x48, 0x75, 0xF0,
-};
+/* used when no definition file is given */
+static const char builtin_patches[] =
+	"[ilpack]\n"
+	"search  = 66 8B 16 8D 74 16 03 81 E6 FC FF FF 0F 48 75 F0\n"
+	"replace = 90 90 90 90 90 90 90 90 90 90 90 90 90 90 90 90\n"
+	"count   = 2+\n";
+
+typedef enum patch_state
+{
+	PATCH_NOT_FOUND,
+	PATCH_APPLICABLE,
+	PATCH_APPLIED,
+	PATCH_AMBIGUOUS,
+} patch_state_t;
 
-/* */
-static const unsigned char replacement[] = {
-	0x90, 0x90, 0x90, 0x90,
-	0x90, 0x90, 0x90, 0x90,
-	0x90, 0x90, 0x90, 0x90,
-	0x90, 0x90, 0x90, 0x90,
+static const char* const patch_state_names[] = {
+	"not applicable", "applicable", "already applied", "ambiguous",
 };
 
+typedef struct patch
+{
+	char* name;
+	/* bytes to look for, a zero mask byte is a wildcard */
+	uint8_t* search;
+	uint8_t* search_mask;
+	/* bytes to put there, a wildcard keeps what is in the file */
+	uint8_t* replace;
+	uint8_t* replace_mask;
+	/* what a site looks like once patched */
+	uint8_t* patched;
+	uint8_t* patched_mask;
+	size_t length;
+	/* number of sites expected, or at least that many */
+	size_t count;
+	bool at_least;
+	bool count_set;
+	/* where exactly the sites are, if known */
+	size_t* offsets;
+	size_t offset_count;
+	bool selected;
+	int line;
+} patch_t;
+
+typedef struct patch_set
+{
+	patch_t* patches;
+	size_t count;
+} patch_set_t;
+
+/* one site of one patch to be written */
+typedef struct edit
+{
+	size_t offset;
+	const patch_t* patch;
+} edit_t;
+
 int exit_status = EXIT_SUCCESS;
 
-int apply_patch(const char* filename); 
+static bool load_patches(const char* filename, patch_set_t* set);
+static bool parse_patches(const char* source, char* text, patch_set_t* set);
+static void free_patches(patch_set_t* set);
+int apply_patch(const char* filename, const patch_set_t* set, bool atomic, bool dry_run);
 
 int main(int argc, char** argv)
 {
-	if(argc < 2)
+	bool atomic = false;
+	bool dry_run = false;
+	const char* definitions = NULL;
+	char** names = calloc(argc, sizeof *names);
+	size_t name_count = 0;
+	patch_set_t set = { 0 };
+	int opt;
+
+	while((opt = getopt(argc, argv, "af:np:h")) != -1)
 	{
-		fprintf(stderr, "Usage: %s  -  %s\n", argv[0], ".dpl file to patch");
+		switch(opt)
+		{
+		case 'a':
+			atomic = true;
+			break;
+		case 'f':
+			definitions = optarg;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'p':
+			names[name_count++] = optarg;
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if(optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-a] [-n] [-f patches.def] [-p name]... <file.dpl>...\n", argv[0]);
+		fprintf(stderr, "  -a  write a patched copy and rename it over the original instead of patching in place\n");
+		fprintf(stderr, "  -f  read patch definitions from a file instead of using the built-in one\n");
+		fprintf(stderr, "  -n  only report what each patch would do\n");
+		fprintf(stderr, "  -p  only apply the named patch, may be repeated\n");
 		exit(EXIT_FAILURE);
 	}
 
-	char* filename = argv[1];
+	if(definitions ? !load_patches(definitions, &set) : !parse_patches("built-in", strdup(builtin_patches), &set))
+		exit(EXIT_FAILURE);
 
-	exit_status = apply_patch(filename);
+	for(size_t i = 0; i < set.count; i++)
+		set.patches[i].selected = name_count == 0;
 
+	for(size_t n = 0; n < name_count; n++)
+	{
+		size_t i = 0;
+		while(i < set.count && strcmp(set.patches[i].name, names[n]) != 0)
+			i++;
+		if(i == set.count)
+		{
+			fprintf(stderr, "ERROR: No patch named %s!\n", names[n]);
+			exit(EXIT_FAILURE);
+		}
+		set.patches[i].selected = true;
+	}
+
+	for(int i = optind; i < argc; i++)
+		if(apply_patch(argv[i], &set, atomic, dry_run) != EXIT_SUCCESS)
+			exit_status = EXIT_FAILURE;
+
+	free_patches(&set);
+	free(names);
 	exit(exit_status);
 }
 
-int apply_patch(const char* filename) 
+static char* trim(char* s)
 {
-	int exit_status = EXIT_SUCCESS;
-    	size_t read = 0;
-    	size_t written = 0;
-    	size_t size = 0;
-	uint32_t pattern_count = 0;
-	uint32_t replacement_count = 0;
-	off_t pattern_offsets[4] = { 0 };
-	off_t replacement_offsets[4] = { 0 };
-	struct stat sb;
-	FILE* file = NULL;
-	uint8_t* data = NULL;
+	while(isspace((unsigned char)*s))
+		s++;
+
+	char* end = s + strlen(s);
+	while(end > s && isspace((unsigned char)end[-1]))
+		*--end = 0;
+
+	return s;
+}
+
+static bool load_patches(const char* filename, patch_set_t* set)
+{
+	FILE* file = fopen(filename, "r");
+	size_t size = 0, capacity = 4096;
+	char* text = malloc(capacity);
 
-	/* check for existence and get file size */
-	if((exit_status = stat(filename, &sb)) != 0)
+	if(!file || !text)
 	{
-		fprintf(stderr, "ERROR: Source file not found: %s %d!\n", filename, exit_status);
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "ERROR: Cannot open patch definitions: %s: %s!\n", filename, strerror(errno));
+		free(text);
+		if(file)
+			fclose(file);
+		return false;
 	}
-	size = sb.st_size;
 
-	/* open file */
-	file = fopen(filename, "rb");
-	if(!file)
-    	{
-    		fprintf(stderr, "ERROR: Cannot open source file: %s!\n", filename);
-    		exit(EXIT_FAILURE);
-    	}
-
-	/* allocate data of size for file */
-	data = calloc(1, sb.st_size * sizeof(uint8_t));
-
-	/* read data in quad part chunks of 512 bytes and display progress */
-	file_block_t* ptr = (file_block_t*)&data[0];
-	for(read = 0; read < size; read += fread(ptr++, sizeof(uint8_t), sizeof(file_block_t), file))
-		status_progress_update("Loading AOW patch file", read, size);
-	exit_status = status_progress_finish("Loading AOW patch file", read, size);
-	fflush(stdout);
+	for(;;)
+	{
+		size += fread(text + size, 1, capacity - size - 1, file);
+		if(size < capacity - 1)
+			break;
+
+		char* grown = realloc(text, capacity *= 2);
+		if(!grown)
+		{
+			fprintf(stderr, "ERROR: Out of memory reading %s!\n", filename);
+			free(text);
+			fclose(file);
+			return false;
+		}
+		text = grown;
+	}
+	text[size] = 0;
 	fclose(file);
 
-	/* match pattern in data of file read */
-	assert(sizeof pattern == sizeof replacement);
-	for(read = 0; read < (size - sizeof pattern); read += sizeof pattern)
+	return parse_patches(filename, text, set);
+}
+
+/* check a patch once all of its lines are read and work out what its sites
+   look like once patched */
+static const char* finish_patch(patch_t* patch)
+{
+	if(!patch->search)
+		return "no search bytes";
+	if(!patch->replace)
+		return "no replace bytes";
+
+	patch->patched = malloc(patch->length);
+	patch->patched_mask = malloc(patch->length);
+	if(!patch->patched || !patch->patched_mask)
+		return "out of memory";
+
+	bool changes = false;
+	for(size_t i = 0; i < patch->length; i++)
+	{
+		patch->patched[i] = patch->replace_mask[i] ? patch->replace[i] : patch->search[i];
+		patch->patched_mask[i] = patch->replace_mask[i] | patch->search_mask[i];
+		changes |= patch->replace_mask[i] != 0;
+	}
+	if(!changes)
+		return "replace bytes are all wildcards";
+
+	if(patch->offset_count)
+	{
+		if(patch->count_set && (patch->at_least ? patch->count > patch->offset_count : patch->count != patch->offset_count))
+			return "count does not match offsets";
+		patch->count = patch->offset_count;
+		patch->at_least = false;
+	}
+	else if(!patch->count_set)
 	{
-		if (memcmp(&data[0] + read, pattern, sizeof pattern) == 0)
+		/* without a count every site found is patched */
+		patch->count = 1;
+		patch->at_least = true;
+	}
+
+	return NULL;
+}
+
+/* definitions are ini style, a [name] line starts each patch followed by
+   search, replace and optionally count (N or N+ for at least N) and offsets */
+static bool parse_patches(const char* source, char* text, patch_set_t* set)
+{
+	char* line = text;
+	const char* error = NULL;
+	int line_number = 0;
+	patch_t* patch = NULL;
+
+	while(line && !error)
+	{
+		char* next = strchr(line, '\n');
+		if(next)
+			*next++ = 0;
+		line_number++;
+
+		char* p = trim(line);
+		line = next;
+		if(*p == 0 || *p == '#' || *p == ';')
+			continue;
+
+		if(*p == '[')
 		{
-			fprintf(stdout, "Pattern found %lu %lu\n", pattern_count, read);
-			pattern_offsets[pattern_count++] = read;
+			char* close = strchr(p, ']');
+			if(!close || close[1] || close == p + 1)
+			{
+				error = "bad section header";
+				break;
+			}
+			*close = 0;
+
+			if(patch && (error = finish_patch(patch)))
+			{
+				line_number = patch->line;
+				break;
+			}
+
+			for(size_t i = 0; i < set->count; i++)
+				if(strcmp(set->patches[i].name, p + 1) == 0)
+					error = "duplicate patch name";
+
+			patch_t* grown = realloc(set->patches, (set->count + 1) * sizeof *grown);
+			if(!grown)
+				error = "out of memory";
+			if(error)
+				break;
+
+			set->patches = grown;
+			patch = &set->patches[set->count++];
+			memset(patch, 0, sizeof *patch);
+			patch->name = strdup(p + 1);
+			patch->line = line_number;
+			continue;
+		}
+
+		char* equals = strchr(p, '=');
+		if(!equals)
+		{
+			error = "expected key = value";
+			break;
+		}
+		if(!patch)
+		{
+			error = "key outside of a [patch] section";
+			break;
+		}
+		*equals = 0;
+
+		char* key = trim(p);
+		char* value = trim(equals + 1);
+		size_t length = 0;
+
+		if(strcmp(key, "search") == 0 || strcmp(key, "replace") == 0)
+		{
+			bool search = key[0] == 's';
+			uint8_t** bytes = search ? &patch->search : &patch->replace;
+			uint8_t** mask = search ? &patch->search_mask : &patch->replace_mask;
+
+			if(*bytes)
+				error = "key given twice";
+			else if(!sig_parse(value, bytes, mask, &length))
+				error = "bad byte string";
+			else if(patch->length && length != patch->length)
+				error = "search and replace differ in length";
+			else if(search && !memchr(*mask, 0xFF, length))
+				error = "search bytes are all wildcards";
+			patch->length = length;
 		}
+		else if(strcmp(key, "count") == 0)
+		{
+			char* end;
+			patch->count = strtoul(value, &end, 10);
+			patch->at_least = *end == '+';
+			patch->count_set = true;
+			if(end == value || end[patch->at_least] || patch->count == 0)
+				error = "bad count";
+		}
+		else if(strcmp(key, "offsets") == 0)
+		{
+			for(char* s = value; *s; )
+			{
+				char* end;
+				size_t offset = strtoull(s, &end, 0);
+				size_t* grown = realloc(patch->offsets, (patch->offset_count + 1) * sizeof *grown);
+
+				if(end == s || !grown)
+				{
+					error = grown ? "bad offset" : "out of memory";
+					break;
+				}
+				patch->offsets = grown;
+
+				/* kept sorted, matches come back in ascending order */
+				size_t i = patch->offset_count++;
+				while(i > 0 && patch->offsets[i - 1] > offset)
+				{
+					patch->offsets[i] = patch->offsets[i - 1];
+					i--;
+				}
+				patch->offsets[i] = offset;
+
+				s = end;
+				while(*s == ',' || isspace((unsigned char)*s))
+					s++;
+			}
+		}
+		else
+			error = "unknown key";
 	}
 
-	if(exit_status != EXIT_SUCCESS)
+	if(!error && patch && (error = finish_patch(patch)))
+		line_number = patch->line;
+	if(!error && set->count == 0)
+		error = "no patches defined";
+
+	if(error)
+		fprintf(stderr, "ERROR: %s:%d: %s!\n", source, line_number, error);
+
+	free(text);
+	return error == NULL;
+}
+
+static void free_patches(patch_set_t* set)
+{
+	for(size_t i = 0; i < set->count; i++)
 	{
-		free(data);
-		return exit_status;
+		patch_t* patch = &set->patches[i];
+		free(patch->name);
+		free(patch->search);
+		free(patch->search_mask);
+		free(patch->replace);
+		free(patch->replace_mask);
+		free(patch->patched);
+		free(patch->patched_mask);
+		free(patch->offsets);
 	}
+	free(set->patches);
+}
+
+static bool has_offset(const match_list_t* list, size_t offset)
+{
+	for(size_t i = 0; i < list->count && list->offsets[i] <= offset; i++)
+		if(list->offsets[i] == offset)
+			return true;
+	return false;
+}
 
-	for(read = 0; read < (size - sizeof pattern); read += sizeof pattern)
+static bool count_fits(const patch_t* patch, size_t count)
+{
+	return patch->at_least ? count >= patch->count : count == patch->count;
+}
+
+/* sites are the search matches, patched the matches of the patched bytes */
+static patch_state_t patch_state(const patch_t* patch, const match_list_t* sites, const match_list_t* patched)
+{
+	if(patch->offset_count)
 	{
-		if (memcmp(&data[0] + read, replacement, sizeof replacement) == 0)
+		size_t found = 0, applied = 0;
+		for(size_t i = 0; i < patch->offset_count; i++)
 		{
-			fprintf(stdout, "Replacement found %lu %lu\n", replacement_count, read);
-			replacement_offsets[replacement_count++] = read;
+			found += has_offset(sites, patch->offsets[i]);
+			applied += has_offset(patched, patch->offsets[i]);
 		}
+
+		if(sites->count == patch->offset_count && found == patch->offset_count)
+			return PATCH_APPLICABLE;
+		if(sites->count == 0)
+			return applied == patch->offset_count ? PATCH_APPLIED : PATCH_NOT_FOUND;
+		return PATCH_AMBIGUOUS;
 	}
-	/* verify patch */
-	if (pattern_count == 0 && replacement_count >= 2)
+
+	if(sites->count)
+		return count_fits(patch, sites->count) ? PATCH_APPLICABLE : PATCH_AMBIGUOUS;
+
+	/* a longer run of patched bytes matches at every offset along it, so
+	   only count matches that don't overlap */
+	size_t applied = 0;
+	for(size_t i = 0, next = 0; i < patched->count; i++)
 	{
-		fprintf(stderr, "Patch already applied!\n");
+		if(patched->offsets[i] < next)
+			continue;
+		applied++;
+		next = patched->offsets[i] + patch->length;
+	}
+
+	/* a file with none of the bytes is not patched */
+	return applied && count_fits(patch, applied) ? PATCH_APPLIED : PATCH_NOT_FOUND;
+}
+
+static void report_patch(const patch_t* patch, patch_state_t state, const match_list_t* sites)
+{
+	fprintf(stdout, "%s: %s", patch->name, patch_state_names[state]);
+
+	if(state == PATCH_AMBIGUOUS || state == PATCH_NOT_FOUND)
+		fprintf(stdout, ", found %zu, expected %s%zu", sites->count, patch->at_least ? "at least " : "", patch->count);
+
+	for(size_t i = 0; i < sites->count; i++)
+		fprintf(stdout, "%s%zu", i ? " " : " at ", sites->offsets[i]);
+	fprintf(stdout, "\n");
+}
+
+static int compare_edits(const void* a, const void* b)
+{
+	size_t x = ((const edit_t*)a)->offset;
+	size_t y = ((const edit_t*)b)->offset;
+	return (x > y) - (x < y);
+}
+
+/* write size bytes at offset, going round again after short writes */
+static bool pwrite_all(int fd, const void* data, size_t size, off_t offset)
+{
+	const uint8_t* p = data;
+
+	while(size)
+	{
+		ssize_t n = pwrite(fd, p, size, offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+/* write one patch site, wildcards in the replacement keep the file's bytes */
+static bool write_edit(int fd, const uint8_t* data, const edit_t* edit, uint8_t* scratch)
+{
+	const patch_t* patch = edit->patch;
+
+	for(size_t i = 0; i < patch->length; i++)
+		scratch[i] = patch->replace_mask[i] ? patch->replace[i] : data[edit->offset + i];
+
+	return pwrite_all(fd, scratch, patch->length, edit->offset);
+}
+
+/* copy of data with the patches applied, next to filename, renamed over it
+   once it is safely on disk */
+static int write_atomic(const char* filename, const uint8_t* data, size_t size, const struct stat* sb, const edit_t* edits, size_t edit_count, uint8_t* scratch)
+{
+	size_t length = strlen(filename);
+	char* temp = malloc(length + 8);
+	int fd;
+	bool ok;
+
+	if(!temp)
+		return EXIT_FAILURE;
+
+	memcpy(temp, filename, length);
+	memcpy(temp + length, ".XXXXXX", 8);
+
+	fd = mkstemp(temp);
+	if(fd < 0)
+	{
+		fprintf(stderr, "ERROR: Cannot create temporary file next to %s: %s!\n", filename, strerror(errno));
+		free(temp);
+		return EXIT_FAILURE;
+	}
+
+	ok = pwrite_all(fd, data, size, 0);
+	for(size_t i = 0; ok && i < edit_count; i++)
+		ok = write_edit(fd, data, &edits[i], scratch);
+
+	ok = ok && fchmod(fd, sb->st_mode & 07777) == 0 && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	ok = ok && rename(temp, filename) == 0;
+
+	if(!ok)
+	{
+		fprintf(stderr, "ERROR: Cannot write %s: %s!\n", temp, strerror(errno));
+		unlink(temp);
+	}
+
+	free(temp);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int apply_patch(const char* filename, const patch_set_t* set, bool atomic, bool dry_run)
+{
+	int exit_status = EXIT_SUCCESS;
+	size_t size = 0;
+	size_t shortest = SIZE_MAX, longest = 0;
+	size_t applicable = 0, unusable = 0;
+	size_t edit_count = 0;
+	const patch_t** patches = calloc(set->count, sizeof *patches);
+	signature_t* signatures = calloc(2 * set->count, sizeof *signatures);
+	match_list_t* matches = calloc(2 * set->count, sizeof *matches);
+	edit_t* edits = NULL;
+	uint8_t* scratch = NULL;
+	size_t count = 0;
+	struct stat sb;
+	uint8_t* data = MAP_FAILED;
+	int fd = -1;
+
+	if(!patches || !signatures || !matches)
+	{
+		fprintf(stderr, "ERROR: Out of memory patching %s!\n", filename);
 		exit_status = EXIT_FAILURE;
+		goto done;
 	}
-	if(exit_status != EXIT_SUCCESS)
+
+	/* search and patched bytes of every selected patch, all found in the
+	   same pass over the file */
+	for(size_t i = 0; i < set->count; i++)
 	{
-		free(data);
-		return exit_status;
+		const patch_t* patch = &set->patches[i];
+		if(!patch->selected)
+			continue;
+
+		signatures[2 * count] = (signature_t){ patch->search, patch->search_mask, patch->length };
+		signatures[2 * count + 1] = (signature_t){ patch->patched, patch->patched_mask, patch->length };
+		patches[count++] = patch;
+
+		if(patch->length < shortest)
+			shortest = patch->length;
+		if(patch->length > longest)
+			longest = patch->length;
 	}
-	if (pattern_count < 2)
+
+	/* open file, check for existence and get file size */
+	fd = open(filename, atomic || dry_run ? O_RDONLY : O_RDWR);
+	if(fd < 0)
 	{
-		fprintf(stderr, "Patch not applicable!\n");
+		fprintf(stderr, "ERROR: Cannot open source file: %s: %s!\n", filename, strerror(errno));
 		exit_status = EXIT_FAILURE;
+		goto done;
 	}
 
-	if(exit_status != EXIT_SUCCESS)
+	if(fstat(fd, &sb) != 0 || sb.st_size < (off_t)shortest)
 	{
-		free(data);
-		return exit_status;
+		fprintf(stderr, "ERROR: Source file too small: %s!\n", filename);
+		exit_status = EXIT_FAILURE;
+		goto done;
 	}
+	size = sb.st_size;
 
-	/* replace patterns in data */
-	size_t i = 0;
-	for(i = 0; i < pattern_count; i++)
+	/* map it rather than read it, only the patched bytes are ever written */
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if(data == MAP_FAILED)
 	{
-		
-		status_progress_update("Replacing pattern", i, pattern_count);
-		memcpy(&data[pattern_offsets[i]], &replacement[0], sizeof replacement);
+		fprintf(stderr, "ERROR: Cannot map source file: %s: %s!\n", filename, strerror(errno));
+		exit_status = EXIT_FAILURE;
+		goto done;
 	}
-	exit_status = status_progress_finish("Replacing pattern", i, pattern_count);
+	madvise(data, size, MADV_SEQUENTIAL);
 
-	if(exit_status != EXIT_SUCCESS)
+	if(!sig_scan(data, size, signatures, 2 * count, matches))
 	{
-		free(data);
-		return exit_status;
+		fprintf(stderr, "ERROR: Out of memory while scanning %s!\n", filename);
+		exit_status = EXIT_FAILURE;
+		goto done;
 	}
 
-	/* open file */
-	file = fopen(filename, "wb");
-	if(!file)
-    	{
-    		fprintf(stderr, "ERROR: Cannot open source file: %s!\n", filename);
-		free(data);
-    		exit(EXIT_FAILURE);
-    	}
+	for(size_t i = 0; i < count; i++)
+	{
+		patch_state_t state = patch_state(patches[i], &matches[2 * i], &matches[2 * i + 1]);
 
-	/* write data in quad part chunks of 512 bytes and display progress */
-	ptr = (file_block_t*)&data[0];
-	for(written = 0; written < size; written += fwrite(ptr++, sizeof(uint8_t), sizeof(file_block_t), file))
-		status_progress_update("Writing modified AOW patch file", written, size);
-	exit_status = status_progress_finish("Writing modified AOW patch file", written, size);
-	fflush(stdout);
-	fflush(file);
-	fclose(file);
+		report_patch(patches[i], state, &matches[2 * i]);
+		if(state == PATCH_APPLICABLE)
+		{
+			applicable++;
+			edit_count += matches[2 * i].count;
+		}
+		else if(state != PATCH_APPLIED)
+			unusable++;
+	}
 
-	free(data);
-	return exit_status == EXIT_FAILURE ? false : true;
-}
+	/* verify patches, nothing is written unless every one of them fits */
+	if(unusable)
+	{
+		fprintf(stderr, "Patch not applicable!\n");
+		exit_status = EXIT_FAILURE;
+		goto done;
+	}
+	if(applicable == 0)
+	{
+		fprintf(stderr, "Patch already applied!\n");
+		exit_status = EXIT_FAILURE;
+		goto done;
+	}
+	if(dry_run)
+		goto done;
+
+	edits = malloc(edit_count * sizeof *edits);
+	scratch = malloc(longest);
+	if(!edits || !scratch)
+	{
+		fprintf(stderr, "ERROR: Out of memory patching %s!\n", filename);
+		exit_status = EXIT_FAILURE;
+		goto done;
+	}
+
+	edit_count = 0;
+	for(size_t i = 0; i < count; i++)
+		for(size_t j = 0; j < matches[2 * i].count; j++)
+			edits[edit_count++] = (edit_t){ matches[2 * i].offsets[j], patches[i] };
+
+	/* two patches writing over the same bytes would depend on the order */
+	qsort(edits, edit_count, sizeof *edits, compare_edits);
+	for(size_t i = 1; i < edit_count; i++)
+	{
+		if(edits[i - 1].offset + edits[i - 1].patch->length > edits[i].offset)
+		{
+			fprintf(stderr, "ERROR: Patches %s and %s overlap at %zu!\n", edits[i - 1].patch->name, edits[i].patch->name, edits[i].offset);
+			exit_status = EXIT_FAILURE;
+			goto done;
+		}
+	}
 
+	if(atomic)
+	{
+		exit_status = write_atomic(filename, data, size, &sb, edits, edit_count, scratch);
+		goto done;
+	}
+
+	/* replace patterns in place, nothing else of the file is touched */
+	size_t i = 0;
+	for(i = 0; i < edit_count; i++)
+	{
+		status_progress_update("Replacing pattern", i, edit_count);
+		if(!write_edit(fd, data, &edits[i], scratch))
+		{
+			fprintf(stderr, "\nERROR: Cannot write %s: %s!\n", filename, strerror(errno));
+			break;
+		}
+	}
+	exit_status = status_progress_finish("Replacing pattern", i, edit_count);
+
+done:
+	for(size_t i = 0; matches && i < 2 * count; i++)
+		match_list_free(&matches[i]);
+	free(matches);
+	free(signatures);
+	free(patches);
+	free(edits);
+	free(scratch);
+	if(data != MAP_FAILED)
+		munmap(data, size);
+	if(fd >= 0 && close(fd) != 0)
+		exit_status = EXIT_FAILURE;
+	return exit_status;
+}
@@ -0,0 +1,102 @@
+/*
+	Per thread scratch memory for ilb2png
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Bump allocator. Everything allocated is dropped at once by reset, and a
+// reset after a pass that needed more than one block merges them into a
+// single block big enough for all of it, so repeating the same work never
+// touches the heap again.
+class Arena
+{
+public:
+	void *alloc(size_t size)
+	{
+		size = (size + Align - 1) & ~(Align - 1);
+
+		if (blocks.empty() || blocks.back().size - blocks.back().used < size)
+		{
+			size_t blockSize = std::max<size_t>(size, blocks.empty() ? MinBlock : 2 * blocks.back().size);
+			blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[blockSize]), blockSize, 0 });
+		}
+
+		Block &block = blocks.back();
+		void *p = block.data.get() + block.used;
+
+		block.used += size;
+		total += size;
+		last = p;
+
+		return p;
+	}
+
+	// Grows the newest allocation in place if there is room behind it
+	void *realloc(void *p, size_t oldSize, size_t newSize)
+	{
+		if (!p)
+			return alloc(newSize);
+
+		if (p == last)
+		{
+			Block &block = blocks.back();
+			size_t offset = static_cast<uint8_t*>(p) - block.data.get();
+			size_t size = (newSize + Align - 1) & ~(Align - 1);
+
+			if (block.size - offset >= size)
+			{
+				total += offset + size - block.used;
+				block.used = offset + size;
+				return p;
+			}
+		}
+
+		void *q = alloc(newSize);
+		memcpy(q, p, std::min(oldSize, newSize));
+		return q;
+	}
+
+	void reset()
+	{
+		if (blocks.size() > 1)
+		{
+			size_t blockSize = std::max(total, MinBlock);
+
+			blocks.clear();
+			blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[blockSize]), blockSize, 0 });
+		}
+		else if (!blocks.empty())
+		{
+			blocks.back().used = 0;
+		}
+
+		total = 0;
+		last = nullptr;
+	}
+
+private:
+	static constexpr size_t Align = 16;
+	static constexpr size_t MinBlock = 1 << 20;
+
+	struct Block
+	{
+		std::unique_ptr<uint8_t[]> data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Block> blocks;
+	// Bytes handed out since the last reset, over all blocks
+	size_t total = 0;
+	void *last = nullptr;
+};
+
+#endif
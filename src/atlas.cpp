@@ -0,0 +1,259 @@
+/*
+	Texture atlas output for ilb2png
+*/
+
+#include "atlas.h"
+#include "imgenc.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+	// Bottom left skyline packer. The skyline is the top edge of everything
+	// placed so far as a list of segments, left to right; a new rectangle
+	// goes wherever it would end up lowest, leftmost on a tie.
+	class Skyline
+	{
+	public:
+		Skyline(size_t width, size_t height) : width(width), height(height)
+		{
+			segments.push_back({ 0, 0, width });
+		}
+
+		bool insert(size_t w, size_t h, size_t &outX, size_t &outY)
+		{
+			size_t bestY = SIZE_MAX;
+			size_t bestIndex = 0;
+
+			for (size_t i = 0; i < segments.size(); ++i)
+			{
+				size_t y;
+				if (fits(i, w, h, y) && y < bestY)
+				{
+					bestY = y;
+					bestIndex = i;
+				}
+			}
+
+			if (bestY == SIZE_MAX)
+				return false;
+
+			outX = segments[bestIndex].x;
+			outY = bestY;
+			add(bestIndex, outX, bestY + h, w);
+
+			usedW = std::max(usedW, outX + w);
+			usedH = std::max(usedH, bestY + h);
+
+			return true;
+		}
+
+		size_t usedWidth() const { return usedW; }
+		size_t usedHeight() const { return usedH; }
+
+	private:
+		struct Segment
+		{
+			size_t x;
+			size_t y;
+			size_t width;
+		};
+
+		// Whether w x h fits with its left edge on segment i, resting on the
+		// highest segment it spans
+		bool fits(size_t i, size_t w, size_t h, size_t &y) const
+		{
+			size_t x = segments[i].x;
+			if (x + w > width)
+				return false;
+
+			y = 0;
+			for (size_t left = w; left; ++i)
+			{
+				y = std::max(y, segments[i].y);
+				if (y + h > height)
+					return false;
+
+				left -= std::min(left, segments[i].width);
+			}
+
+			return true;
+		}
+
+		// Raises the skyline to top over [x, x + w), starting at segment i
+		void add(size_t i, size_t x, size_t top, size_t w)
+		{
+			segments.insert(segments.begin() + i, { x, top, w });
+
+			// Cut what the new segment covers off the ones after it
+			for (size_t j = i + 1; j < segments.size(); )
+			{
+				Segment &s = segments[j];
+				if (s.x >= x + w)
+					break;
+
+				size_t cut = x + w - s.x;
+				if (cut >= s.width)
+				{
+					segments.erase(segments.begin() + j);
+					continue;
+				}
+
+				s.x += cut;
+				s.width -= cut;
+				break;
+			}
+
+			// Merge neighbours of the same height
+			for (size_t j = 0; j + 1 < segments.size(); )
+			{
+				if (segments[j].y == segments[j + 1].y)
+				{
+					segments[j].width += segments[j + 1].width;
+					segments.erase(segments.begin() + j + 1);
+				}
+				else
+				{
+					++j;
+				}
+			}
+		}
+
+		size_t width;
+		size_t height;
+		size_t usedW = 0;
+		size_t usedH = 0;
+		std::vector<Segment> segments;
+	};
+}
+
+void Atlas::pack(const std::vector<const IlbIndexEntry*> &images)
+{
+	slotList.assign(images.size(), AtlasSlot());
+	pages.clear();
+
+	std::vector<size_t> order;
+	for (size_t i = 0; i < images.size(); ++i)
+		if (images[i]->width && images[i]->height)
+			order.push_back(i);
+
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+	{
+		if (images[a]->height != images[b]->height)
+			return images[a]->height > images[b]->height;
+		return images[a]->width > images[b]->width;
+	});
+
+	std::vector<Skyline> skylines;
+
+	for (size_t i : order)
+	{
+		AtlasSlot &slot = slotList[i];
+		slot.width = images[i]->width;
+		slot.height = images[i]->height;
+
+		// Padding goes right of and below each image
+		size_t w = slot.width + padding;
+		size_t h = slot.height + padding;
+		size_t x = 0, y = 0;
+		size_t page = 0;
+
+		while (page < skylines.size() && !skylines[page].insert(w, h, x, y))
+			page++;
+
+		// A fresh page is made to fit, but should it still refuse the image
+		// stays unpacked and place() leaves it out
+		if (page == skylines.size())
+		{
+			skylines.emplace_back(std::max(w, pageSize), std::max(h, pageSize));
+			if (!skylines.back().insert(w, h, x, y))
+			{
+				skylines.pop_back();
+				continue;
+			}
+		}
+
+		slot.packed = true;
+		slot.page = page;
+		slot.x = x;
+		slot.y = y;
+	}
+
+	// Only as big as what is on them, less the padding of the last row and
+	// column
+	for (const Skyline &skyline : skylines)
+	{
+		pages.push_back(std::make_unique<Image>());
+		pages.back()->reset(skyline.usedWidth() - padding, skyline.usedHeight() - padding);
+	}
+}
+
+bool Atlas::place(size_t index, const std::string &source, uint32_t id, const Image &image)
+{
+	AtlasSlot &slot = slotList[index];
+
+	if (!slot.packed || image.width != slot.width || image.height != slot.height)
+		return false;
+
+	Image &page = *pages[slot.page];
+	size_t stride = 4 * image.width;
+
+	for (size_t y = 0; y < image.height; ++y)
+		memcpy(page.data + 4 * ((slot.y + y) * page.width + slot.x), image.data + stride * y, stride);
+
+	slot.source = source;
+	slot.id = id;
+	slot.name = image.name;
+	slot.xoff = image.xoff;
+	slot.yoff = image.yoff;
+	slot.mode = image.mode;
+	slot.placed = true;
+
+	return true;
+}
+
+void Atlas::manifest(const char *extension, std::string &out) const
+{
+	char line[256];
+
+	out = "{\n\t\"pages\": [\n";
+
+	for (size_t i = 0; i < pages.size(); ++i)
+	{
+		snprintf(line, sizeof line, "\t\t{ \"file\": \"atlas%zu.%s\", \"width\": %zu, \"height\": %zu }%s\n",
+			i, extension, pages[i]->width, pages[i]->height, i + 1 < pages.size() ? "," : "");
+		out += line;
+	}
+
+	out += "\t],\n\t\"images\": [";
+
+	bool first = true;
+	for (const AtlasSlot &slot : slotList)
+	{
+		if (!slot.placed)
+			continue;
+
+		out += first ? "\n\t\t{ " : ",\n\t\t{ ";
+
+		if (!slot.source.empty())
+		{
+			out += "\"source\": ";
+			appendJsonString(out, slot.source);
+			out += ", ";
+		}
+
+		snprintf(line, sizeof line, "\"id\": %u, \"name\": ", slot.id);
+		out += line;
+		appendJsonString(out, slot.name, true);
+
+		snprintf(line, sizeof line, ", \"page\": %u, \"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u, \"xoff\": %zu, \"yoff\": %zu, \"mode\": %u }",
+			slot.page, slot.x, slot.y, slot.width, slot.height, slot.xoff, slot.yoff, slot.mode);
+		out += line;
+
+		first = false;
+	}
+
+	out += "\n\t]\n}\n";
+}
@@ -0,0 +1,76 @@
+/*
+	Texture atlas output for ilb2png
+*/
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ilb.h"
+#include "decode.h"
+
+// Where one image went
+struct AtlasSlot
+{
+	bool packed = false;
+	// Set once the decoded image has been copied in
+	bool placed = false;
+
+	uint32_t page = 0;
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	// Subdirectory of the image's ILB in a batch, empty otherwise
+	std::string source;
+	uint32_t id = 0;
+	std::string name;
+	size_t xoff = 0;
+	size_t yoff = 0;
+	uint32_t mode = 0;
+};
+
+// Packs every selected image into a few large pages. Canvas sizes are known
+// from the index, so the layout is settled before anything is decoded and
+// each image is copied into its own rectangle as soon as it is ready. The
+// rectangles never overlap, so any number of threads can place at once.
+class Atlas
+{
+public:
+	// Pages are pageSize square, only an image bigger than that gets a page
+	// of its own size. padding transparent pixels go between images.
+	Atlas(size_t pageSize, size_t padding = 1) : pageSize(pageSize), padding(padding) {}
+
+	// Lays out images, slot i for images[i], with a skyline bottom left
+	// packer, tallest images first, and allocates pages just big enough for
+	// what ended up on them
+	void pack(const std::vector<const IlbIndexEntry*> &images);
+
+	// Copies the decoded image of slot into its rectangle. False if it
+	// doesn't have the size the index promised or it couldn't be packed.
+	bool place(size_t slot, const std::string &source, uint32_t id, const Image &image);
+
+	const std::vector<AtlasSlot> &slots() const { return slotList; }
+	size_t pageCount() const { return pages.size(); }
+	const Image &page(size_t i) const { return *pages[i]; }
+
+	// Replaces out with the JSON manifest: every page file and every placed
+	// image with its page, rectangle, offset, name and mode, and in a batch
+	// the ILB it came from
+	void manifest(const char *extension, std::string &out) const;
+
+private:
+	size_t pageSize;
+	size_t padding;
+
+	std::vector<AtlasSlot> slotList;
+	std::vector<std::unique_ptr<Image>> pages;
+};
+
+#endif
@@ -0,0 +1,349 @@
+/*
+	ILB pixel decoding and compositing
+*/
+
+#include "decode.h"
+#include "pixel.h"
+
+#include <algorithm>
+
+namespace
+{
+	struct Target
+	{
+		size_t dataW;
+		size_t dataH;
+		size_t xoff;
+		size_t yoff;
+		uint8_t *pngData;
+		size_t pngW;
+		// Pixels in pngData. Writes are cut off there, so records that don't
+		// fit their canvas can't run off the end of it.
+		size_t pngSize;
+		// Blend over what is already in pngData instead of overwriting it
+		bool blend;
+		// End of the record's pixel data. Rows and runs are never read past
+		// it, a record that claims more just stops there.
+		const uint8_t *dataEnd;
+	};
+
+	// How many whole units are left between p and the end of the data
+	template <typename Unit>
+	inline size_t available(const Unit *p, const Target &t)
+	{
+		const uint8_t *at = reinterpret_cast<const uint8_t*>(p);
+		return at < t.dataEnd ? (t.dataEnd - at) / sizeof(Unit) : 0;
+	}
+
+	// How many of count pixels starting at pixel pos fit on the canvas
+	inline size_t clip(size_t pos, size_t count, const Target &t)
+	{
+		return pos < t.pngSize ? std::min(count, t.pngSize - pos) : 0;
+	}
+
+	// Writes count converted pixels to pixel pos. Blending goes through a
+	// small scratch buffer on the stack, a chunk at a time, so a layer never
+	// needs a canvas of its own.
+	template <typename Source>
+	void emit(const Source &source, const typename Source::Unit *src, size_t count, size_t pos, const Target &t)
+	{
+		uint8_t *out = t.pngData + 4 * pos;
+
+		count = clip(pos, count, t);
+
+		if (!t.blend)
+		{
+			source.convert(src, count, out);
+			return;
+		}
+
+		uint8_t scratch[4 * 256];
+
+		while (count)
+		{
+			size_t chunk = std::min<size_t>(count, 256);
+
+			source.convert(src, chunk, scratch);
+			compositeOver(scratch, out, chunk);
+
+			src += chunk;
+			out += 4 * chunk;
+			count -= chunk;
+		}
+	}
+
+	// r5g6b5 pixels, alpha mode fixed at compile time
+	template <PixelAlpha Mode>
+	struct Source565
+	{
+		typedef Pixel565 Unit;
+
+		uint32_t transparent;
+		uint8_t alpha;
+
+		Source565(uint32_t transparent, uint8_t alpha) : transparent(transparent), alpha(alpha) {}
+
+		void convert(const Unit *src, size_t count, uint8_t *dst) const
+		{
+			convert565<Mode>(src, count, dst, transparent, alpha);
+		}
+
+		// Row length is stored in bytes as two words and includes itself.
+		// False if it is too short to even hold itself.
+		static const size_t HeaderItems = 2;
+
+		static bool rowItems(const Unit *&row, size_t &items)
+		{
+			uint32_t scanSize = row[0] | (row[1] << 16);
+			row += 2;
+
+			scanSize /= 2;
+
+			if (scanSize & 0x01)
+				scanSize++;
+
+			items = scanSize - 2;
+			return scanSize >= 2;
+		}
+
+		static size_t runLength(Unit count)
+		{
+			return count / 2;
+		}
+	};
+
+	// Palette indices. The alpha mode is baked into a per image lookup table,
+	// so converting is a plain table walk whatever the mode.
+	struct SourcePal8
+	{
+		typedef uint8_t Unit;
+
+		uint32_t transparent;
+		// Finished RGBA pixels, as laid out in memory
+		uint32_t lut[256];
+
+		template <PixelAlpha Mode>
+		void build(Palette palette, uint8_t alpha)
+		{
+			for (size_t i = 0; i < 256; ++i)
+			{
+				uint8_t px[4];
+
+				px[0] = palette[4 * i + 0];
+				px[1] = palette[4 * i + 1];
+				px[2] = palette[4 * i + 2];
+				px[3] = pixelAlpha<Mode>(px[0], px[1], px[2], alpha);
+
+				memcpy(&lut[i], px, 4);
+			}
+
+			if (transparent < 256)
+				lut[transparent] = 0;
+		}
+
+		SourcePal8(uint32_t transparent, Palette palette, PixelAlpha mode, uint8_t alpha) : transparent(transparent)
+		{
+			switch (mode)
+			{
+			case ALPHA_ADDITIVE:
+				build<ALPHA_ADDITIVE>(palette, alpha);
+				break;
+			case ALPHA_BRIGHT:
+				build<ALPHA_BRIGHT>(palette, alpha);
+				break;
+			case ALPHA_MULTIPLY:
+				build<ALPHA_MULTIPLY>(palette, alpha);
+				break;
+			default:
+				build<ALPHA_CONSTANT>(palette, alpha);
+			}
+		}
+
+		void convert(const Unit *src, size_t count, uint8_t *dst) const
+		{
+			convertPal8(src, count, dst, lut);
+		}
+
+		// Row length is stored in bytes as one int and includes itself.
+		// False if it is too short to even hold itself.
+		static const size_t HeaderItems = 4;
+
+		static bool rowItems(const Unit *&row, size_t &items)
+		{
+			uint32_t scanSize = row[0] | (row[1] << 8) | (row[2] << 16) | ((uint32_t)row[3] << 24);
+			row += 4;
+
+			items = scanSize - 4;
+			return scanSize >= 4;
+		}
+
+		static size_t runLength(Unit count)
+		{
+			return count;
+		}
+	};
+
+	template <typename Source>
+	void translateRaw(const Source &source, const typename Source::Unit *data, const Target &t)
+	{
+		size_t items = available(data, t);
+
+		// Rows are contiguous on both sides, so each one is a single convert,
+		// the last one cut short if the data ends early
+		for (size_t y = 0; y < t.dataH && t.dataW*y < items; ++y)
+			emit(source, data + t.dataW*y, std::min(t.dataW, items - t.dataW*y), t.xoff + (y + t.yoff) * t.pngW, t);
+	}
+
+	// Works a row at a time in spans: a transparent marker and its length
+	// become one fill, everything up to the next marker one convert call.
+	// The output position just moves along the row.
+	template <typename Source>
+	void translateRLE(const Source &source, const typename Source::Unit *data, const Target &t)
+	{
+		typedef typename Source::Unit Unit;
+
+		const Unit *row = data;
+
+		for (size_t y = 0; y < t.dataH; ++y)
+		{
+			// A row that doesn't fit what is left of the data ends the layer,
+			// so everything below only ever reads between row and end
+			size_t scanSize;
+			if (available(row, t) < Source::HeaderItems || !Source::rowItems(row, scanSize) || scanSize > available(row, t))
+				break;
+
+			const Unit *in = row;
+			const Unit *end = row + scanSize;
+			size_t pos = t.xoff + (y + t.yoff) * t.pngW;
+
+			while (in < end)
+			{
+				if (*in == source.transparent)
+				{
+					// The marker is followed by the run length, unless it is
+					// the last item of the row, which is a single pixel
+					size_t count = 1;
+					if (in + 1 < end)
+						count = Source::runLength(*++in);
+					in++;
+
+					// Nothing to blend, the canvas shows through
+					if (!t.blend)
+						memset(t.pngData + 4 * pos, 0, 4 * clip(pos, count, t));
+					pos += count;
+					continue;
+				}
+
+				const Unit *literal = in;
+				while (in < end && *in != source.transparent)
+					in++;
+
+				emit(source, literal, in - literal, pos, t);
+				pos += in - literal;
+			}
+
+			row = end;
+		}
+	}
+
+	template <PixelAlpha Mode>
+	void translate565(PixelLayout layout, const Pixel565 *data, const Target &t, uint32_t transparent, uint8_t alpha)
+	{
+		Source565<Mode> source(transparent, alpha);
+
+		if (layout == LAYOUT_RLE16)
+			translateRLE(source, data, t);
+		else
+			translateRaw(source, data, t);
+	}
+}
+
+static void translateTo(bool over, PixelLayout layout, const void *pixelData, size_t dataSize, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent, uint32_t mode, Palette palette)
+{
+	Target t = { dataW, dataH, xoff, yoff, pngData, pngW, pngW * pngH, over, static_cast<const uint8_t*>(pixelData) + dataSize };
+
+	uint8_t a = 255;
+
+	int show = mode & 0x00FF;
+	int blend = (mode >> 8) & 0x00FF;
+
+	if (show == 2 && blend == 1)
+		a = (((blend >> 16) & 0x00FF) * 255) / 100;
+	else if (show == 1)
+		a = 128;
+
+	PixelAlpha alpha = pixelAlphaMode(show, blend);
+
+	if (layout == LAYOUT_RLE8)
+	{
+		SourcePal8 source(transparent, palette, alpha, a);
+		translateRLE(source, static_cast<const uint8_t*>(pixelData), t);
+		return;
+	}
+
+	const Pixel565 *data = static_cast<const Pixel565*>(pixelData);
+
+	switch (alpha)
+	{
+	case ALPHA_ADDITIVE:
+		translate565<ALPHA_ADDITIVE>(layout, data, t, transparent, a);
+		break;
+	case ALPHA_BRIGHT:
+		translate565<ALPHA_BRIGHT>(layout, data, t, transparent, a);
+		break;
+	case ALPHA_MULTIPLY:
+		translate565<ALPHA_MULTIPLY>(layout, data, t, transparent, a);
+		break;
+	default:
+		translate565<ALPHA_CONSTANT>(layout, data, t, transparent, a);
+	}
+}
+
+void translate(PixelLayout layout, const void *pixelData, size_t dataSize, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent, uint32_t mode, Palette palette)
+{
+	translateTo(false, layout, pixelData, dataSize, dataW, dataH, xoff, yoff, pngData, pngW, pngH, transparent, mode, palette);
+}
+
+void translateOver(PixelLayout layout, const void *pixelData, size_t dataSize, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent, uint32_t mode, Palette palette)
+{
+	translateTo(true, layout, pixelData, dataSize, dataW, dataH, xoff, yoff, pngData, pngW, pngH, transparent, mode, palette);
+}
+
+void Image::reset(size_t width, size_t height)
+{
+	size_t size = width * height * 4;
+
+	// Grow with some slack so a run of slightly bigger images doesn't
+	// reallocate every time
+	if (size > capacity)
+	{
+		delete[] data;
+		capacity = std::max(size, capacity + capacity / 2);
+		data = new uint8_t[capacity];
+	}
+
+	this->width = width;
+	this->height = height;
+	xoff = yoff = 0;
+	mode = 0;
+	name.clear();
+
+	memset(data, 0, size);
+}
+
+void Image::composite(const Image &other)
+{
+	// I hope this.width >= other.width always holds true... If it doesn't,
+	// rows still wrap as they always did but stop at the end of the canvas.
+	size_t size = this->width * this->height;
+
+	for (size_t y = 0; y < other.height; ++y)
+	{
+		size_t pos = other.xoff + (y + other.yoff) * this->width;
+		if (pos >= size)
+			break;
+
+		const uint8_t *src = other.data + 4 * y * other.width;
+		compositeOver(src, this->data + 4 * pos, std::min(other.width, size - pos));
+	}
+}
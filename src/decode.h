@@ -0,0 +1,74 @@
+/*
+	ILB pixel decoding and compositing
+*/
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include "ilb.h"
+
+// Pixel data layouts of the supported record types
+enum PixelLayout
+{
+	// Picture16, Sprite16
+	LAYOUT_RAW16,
+	// RLESprite16, TransparentRLESprite16
+	LAYOUT_RLE16,
+	// RLESprite08
+	LAYOUT_RLE8
+};
+
+// Decodes dataW x dataH pixels from the dataSize bytes at pixelData into the
+// RGBA canvas pngData at xoff, yoff. Row sizes and runs are checked against
+// dataSize, a layer whose data ends early or is corrupt stops there. mode is show mode | blend mode << 8 | blend value << 16. palette is only
+// needed for 8 bit layouts. All per pixel decisions are made once here, the
+// inner loops are instantiated per layout and alpha mode.
+void translate(PixelLayout layout, const void *pixelData, size_t dataSize, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent = 0xFFFFFFFF, uint32_t mode = 0, Palette palette = nullptr);
+
+// Same, but blends the pixels over what is already in pngData as they are
+// decoded, exactly like decoding into a blank canvas and compositing that.
+// Transparent pixels leave the canvas alone.
+void translateOver(PixelLayout layout, const void *pixelData, size_t dataSize, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent = 0xFFFFFFFF, uint32_t mode = 0, Palette palette = nullptr);
+
+// An RGBA canvas. The buffer is kept across reset, so one Image can be
+// reused for image after image without going back to the heap.
+struct Image
+{
+	size_t width = 0;
+	size_t height = 0;
+	size_t xoff = 0;
+	size_t yoff = 0;
+	uint8_t *data = nullptr;
+	uint32_t mode = 0;
+	std::string name;
+
+	Image() = default;
+
+	Image(size_t width, size_t height)
+	{
+		reset(width, height);
+	}
+
+	~Image()
+	{
+		delete[] data;
+	}
+
+	Image(const Image &) = delete;
+	Image &operator=(const Image &) = delete;
+
+	// Makes this a blank width x height canvas
+	void reset(size_t width, size_t height);
+
+	void composite(const Image &other);
+
+private:
+	size_t capacity = 0;
+};
+
+#endif
@@ -0,0 +1,449 @@
+/*
+	libilb - Shared reader for AoW1 ILB image libraries
+*/
+
+#include "ilb.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+	// Bounds checked little endian reads out of the mapping. Once a read
+	// runs past the end, ok stays false and every further read yields 0.
+	struct Cursor
+	{
+		const uint8_t *data;
+		size_t size;
+		size_t pos;
+		bool ok;
+
+		Cursor(const uint8_t *data, size_t size, size_t pos) : data(data), size(size), pos(pos), ok(pos <= size) {}
+
+		const uint8_t *bytes(size_t count)
+		{
+			if (!ok || size - pos < count)
+			{
+				ok = false;
+				return nullptr;
+			}
+
+			const uint8_t *p = data + pos;
+			pos += count;
+			return p;
+		}
+
+		uint8_t u8()
+		{
+			const uint8_t *p = bytes(1);
+			return p ? *p : 0;
+		}
+
+		uint32_t u32()
+		{
+			uint32_t v = 0;
+			const uint8_t *p = bytes(sizeof(uint32_t));
+			if (p)
+				memcpy(&v, p, sizeof(uint32_t));
+			return v;
+		}
+
+		float f32()
+		{
+			float v = 0;
+			const uint8_t *p = bytes(sizeof(float));
+			if (p)
+				memcpy(&v, p, sizeof(float));
+			return v;
+		}
+	};
+}
+
+bool ilbKnownType(uint32_t type)
+{
+	switch (type)
+	{
+	case 2:
+	case 16:
+	case 17:
+	case 18:
+	case 22:
+		return true;
+	default:
+		return false;
+	}
+}
+
+IlbFile::~IlbFile()
+{
+	close();
+}
+
+void IlbFile::close()
+{
+	if (map)
+		munmap((void*)map, mapSize);
+	if (fd >= 0)
+		::close(fd);
+
+	fd = -1;
+	map = nullptr;
+	mapSize = 0;
+	hdr = {};
+	palettes.clear();
+	imageList = 0;
+}
+
+bool IlbFile::open(const std::filesystem::path &path)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		lastError = "Failed to open " + path.string() + ": " + strerror(errno);
+		return false;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || sb.st_size == 0)
+	{
+		lastError = "Failed to read " + path.string();
+		close();
+		return false;
+	}
+
+	void *mapping = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		lastError = "Failed to map " + path.string() + ": " + strerror(errno);
+		close();
+		return false;
+	}
+
+	map = static_cast<const uint8_t*>(mapping);
+	mapSize = sb.st_size;
+
+	// The mapping stays valid without it, and a batch may keep thousands of
+	// files open
+	::close(fd);
+	fd = -1;
+
+	Cursor in(map, mapSize, 0);
+
+	hdr.magic = in.u32();
+	hdr.unkID = in.u32();
+	hdr.version = in.f32();
+	hdr.headerLength = in.u32();
+
+	if (hdr.version == 4.0f)
+	{
+		hdr.imgDirectory = in.u32();
+		hdr.fileSize = in.u32();
+	}
+
+	hdr.paletteCount = in.u32();
+
+	for (size_t i = 0; in.ok && i < hdr.paletteCount; ++i)
+	{
+		if (in.u32() != ILB_PALETTE_TYPE && in.ok)
+		{
+			lastError = "Unknown palette type!";
+			close();
+			return false;
+		}
+
+		palettes.push_back(in.bytes(1024));
+	}
+
+	if (!in.ok)
+	{
+		lastError = "Ran off the end of the file!";
+		close();
+		return false;
+	}
+
+	imageList = in.pos;
+
+	return true;
+}
+
+Palette IlbFile::palette(size_t index) const
+{
+	if (index >= palettes.size())
+		return nullptr;
+
+	return palettes[index];
+}
+
+IlbResult IlbFile::readRecord(size_t &pos, IlbRecord &record) const
+{
+	Cursor in(map, mapSize, pos);
+
+	record = IlbRecord();
+	record.type = in.u32();
+
+	// If the type is 256, it's a composite image
+	// we still need the *actual* type though, so read that too
+	if (record.type == ILB_COMPOSITE)
+	{
+		record.composite = true;
+		record.type = in.u32();
+	}
+
+	if (!in.ok)
+		return IlbResult::Truncated;
+
+	if (record.type == ILB_END)
+	{
+		pos = in.pos;
+		return IlbResult::End;
+	}
+
+	// Empty image or end of a composite
+	if (record.type == 0)
+	{
+		pos = in.pos;
+		return IlbResult::Ok;
+	}
+
+	if (!ilbKnownType(record.type))
+	{
+		// Nobody knows the layout, so skip ahead to the next end marker
+		size_t end = 0;
+		for (size_t i = in.pos; i < mapSize; ++i)
+		{
+			if (map[i] == 0xFF)
+				end++;
+			else
+				end = 0;
+
+			if (end == 4)
+			{
+				pos = i + 1;
+				return IlbResult::Unknown;
+			}
+		}
+
+		return IlbResult::Truncated;
+	}
+
+	bool pal = record.type == 2;
+
+	record.infoByte = in.u8();
+
+	uint32_t nameLength = in.u32();
+	const uint8_t *name = in.bytes(nameLength);
+	if (name)
+		record.name = std::string_view(reinterpret_cast<const char*>(name), nameLength);
+
+	record.width = in.u32();
+	record.height = in.u32();
+
+	record.xshift = in.u32();
+	record.yshift = in.u32();
+
+	record.subID = in.u32();
+	record.unknownA = in.u8();
+
+	record.size = in.u32();
+
+	if (record.infoByte != 1)
+		record.offset = in.u32();
+
+	record.totalW = in.u32();
+	record.totalH = in.u32();
+
+	if (pal)
+		record.unknownB = in.u8();
+
+	if (record.infoByte == 3)
+	{
+		record.drawmode = in.u32();
+		record.blendValue = in.u32();
+	}
+
+	record.colorset = in.u32();
+
+	if (record.type != 16)
+	{
+		record.hasSprite = true;
+		record.clipW = in.u32();
+		record.clipH = in.u32();
+		record.clipX = in.u32();
+		record.clipY = in.u32();
+		record.trans = in.u32();
+	}
+
+	if (record.type == 2 || record.type == 17 || record.type == 18)
+	{
+		record.hasUnknownE = true;
+		record.unknownE = in.u32();
+	}
+
+	// v3 keeps the pixels right behind the record, v4 in the image directory
+	if (record.infoByte == 1)
+	{
+		record.data = in.bytes(record.size);
+	}
+	else
+	{
+		size_t dataPos = (size_t)hdr.imgDirectory + record.offset;
+		if (dataPos <= mapSize && mapSize - dataPos >= record.size)
+			record.data = map + dataPos;
+		else
+			in.ok = false;
+	}
+
+	if (!in.ok)
+		return IlbResult::Truncated;
+
+	pos = in.pos;
+	return IlbResult::Ok;
+}
+
+IlbResult IlbFile::readImage(size_t &pos, IlbImage &image) const
+{
+	Cursor in(map, mapSize, pos);
+
+	image.layers.clear();
+	image.id = in.u32();
+
+	if (!in.ok || image.id == ILB_END)
+		return IlbResult::End;
+
+	size_t at = in.pos;
+	IlbResult res;
+
+	do
+	{
+		IlbRecord record;
+		res = readRecord(at, record);
+
+		if (res == IlbResult::Truncated)
+			return res;
+
+		if (res != IlbResult::End)
+			image.layers.push_back(record);
+
+	} while (res == IlbResult::Ok);
+
+	pos = at;
+	return IlbResult::Ok;
+}
+
+IlbResult IlbFile::buildIndex(std::vector<IlbIndexEntry> &index) const
+{
+	size_t pos = imageList;
+	IlbImage image;
+
+	index.clear();
+
+	for (;;)
+	{
+		IlbIndexEntry entry = {};
+		entry.offset = pos;
+
+		IlbResult res = readImage(pos, image);
+		if (res == IlbResult::End)
+			return IlbResult::Ok;
+		if (res != IlbResult::Ok)
+			return res;
+
+		entry.id = image.id;
+
+		for (const IlbRecord &record : image.layers)
+		{
+			if (!ilbKnownType(record.type))
+				continue;
+
+			if (entry.layerCount++ == 0)
+			{
+				entry.type = record.type;
+				entry.name = record.name;
+				entry.width = record.totalW;
+				entry.height = record.totalH;
+			}
+
+			entry.size += record.size;
+		}
+
+		index.push_back(entry);
+	}
+}
+
+IlbResult IlbFile::dataExtents(size_t pos, std::vector<IlbExtent> &extents) const
+{
+	Cursor in(map, mapSize, pos);
+
+	if (in.u32() == ILB_END || !in.ok)
+		return IlbResult::End;
+
+	size_t at = in.pos;
+	IlbResult res;
+
+	do
+	{
+		IlbRecord record;
+		res = readRecord(at, record);
+
+		if (res == IlbResult::Truncated)
+			return res;
+
+		if (res == IlbResult::Ok && record.data && record.size)
+			extents.push_back({ (size_t)(record.data - map), record.size });
+
+	} while (res == IlbResult::Ok);
+
+	return IlbResult::Ok;
+}
+
+void IlbFile::coalesce(std::vector<IlbExtent> &extents, size_t gap)
+{
+	if (extents.empty())
+		return;
+
+	std::sort(extents.begin(), extents.end(), [](const IlbExtent &a, const IlbExtent &b)
+	{
+		return a.offset < b.offset;
+	});
+
+	size_t out = 0;
+
+	for (size_t i = 1; i < extents.size(); ++i)
+	{
+		IlbExtent &last = extents[out];
+		size_t end = last.offset + last.size;
+
+		if (extents[i].offset <= end + gap)
+			last.size = std::max(end, extents[i].offset + extents[i].size) - last.offset;
+		else
+			extents[++out] = extents[i];
+	}
+
+	extents.resize(out + 1);
+}
+
+void IlbFile::prefetch(const IlbExtent &extent) const
+{
+	static const size_t page = sysconf(_SC_PAGESIZE);
+
+	if (!map || extent.offset >= mapSize)
+		return;
+
+	size_t begin = extent.offset & ~(page - 1);
+	size_t end = std::min(extent.offset + extent.size, mapSize);
+
+	madvise(const_cast<uint8_t*>(map) + begin, end - begin, MADV_WILLNEED);
+
+	uint8_t sum = 0;
+	for (size_t i = begin; i < end; i += page)
+		sum += *(volatile const uint8_t*)(map + i);
+
+	(void)sum;
+}
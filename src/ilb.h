@@ -0,0 +1,199 @@
+/*
+	libilb - Shared reader for AoW1 ILB image libraries
+
+	The file is mapped once and every structure handed out by the reader
+	(header, palettes, image records, pixel data) points straight into that
+	mapping. Nothing is copied, so all views stay valid only as long as the
+	IlbFile they came from is open.
+*/
+
+#ifndef ILB_H
+#define ILB_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+// Magic should be 0x424C4904, or 0x04,'ILB'
+#define ILB_MAGIC        0x424C4904
+#define ILB_PALETTE_TYPE 0x88801B18
+#define ILB_PIXEL_565    0x56509310
+#define ILB_COMPOSITE    256
+#define ILB_END          0xFFFFFFFF
+
+// As far as anyone has been able to find, the palettes have only ever been
+// r8g8b8x8, so a palette is just a pointer to 256 of those in the mapping.
+typedef const uint8_t *Palette;
+
+struct IlbHeader
+{
+	uint32_t magic;
+	// Unknown, seemingly useless value
+	uint32_t unkID;
+	// Float because idklol
+	float version;
+	// Length of the header even though it doesn't change within versions
+	uint32_t headerLength;
+
+	// v4 only
+	uint32_t imgDirectory;
+	uint32_t fileSize;
+
+	uint32_t paletteCount;
+};
+
+// A single layer out of the record stream. Fields that don't exist for the
+// record's type are zero.
+struct IlbRecord
+{
+	uint32_t type;
+	bool composite;
+
+	uint8_t infoByte;
+	std::string_view name;
+	uint32_t width;
+	uint32_t height;
+	uint32_t xshift;
+	uint32_t yshift;
+
+	uint32_t subID;
+	uint8_t unknownA;
+
+	uint32_t size;
+	uint32_t offset;
+
+	uint32_t totalW;
+	uint32_t totalH;
+
+	uint8_t unknownB;
+	uint32_t drawmode;
+	uint32_t blendValue;
+
+	// Pixel format for 16 bit types, palette index for type 2
+	uint32_t colorset;
+
+	bool hasSprite;
+	uint32_t clipW;
+	uint32_t clipH;
+	uint32_t clipX;
+	uint32_t clipY;
+	uint32_t trans;
+
+	bool hasUnknownE;
+	uint32_t unknownE;
+
+	// size bytes of pixel data, either inline (InfoByte 1) or in the v4
+	// image directory
+	const uint8_t *data;
+};
+
+// One entry of the image list: an ID and all of its layers in file order.
+// Composite images end with a type 0 layer, unhandled types end the image.
+struct IlbImage
+{
+	uint32_t id;
+	std::vector<IlbRecord> layers;
+};
+
+// One row of the image directory index, built from the record headers
+// alone. Pixel data is never touched while indexing.
+struct IlbIndexEntry
+{
+	uint32_t id;
+	// Type and name of the first layer, 0 and empty for empty images
+	uint32_t type;
+	std::string_view name;
+	// Canvas size of the first layer
+	uint32_t width;
+	uint32_t height;
+	uint32_t layerCount;
+	// Position of the image in the record stream, for readImage
+	size_t offset;
+	// Pixel data bytes over all layers
+	size_t size;
+};
+
+// A range of bytes in the file
+struct IlbExtent
+{
+	size_t offset;
+	size_t size;
+};
+
+enum class IlbResult
+{
+	Ok,
+	// End marker of an image (readRecord) or of the image list (readImage)
+	End,
+	// Unhandled record type; skipped up to the next end marker
+	Unknown,
+	// Ran off the end of the file
+	Truncated
+};
+
+bool ilbKnownType(uint32_t type);
+
+class IlbFile
+{
+public:
+	IlbFile() = default;
+	~IlbFile();
+
+	IlbFile(const IlbFile &) = delete;
+	IlbFile &operator=(const IlbFile &) = delete;
+
+	bool open(const std::filesystem::path &path);
+	void close();
+
+	const std::string &error() const { return lastError; }
+
+	const IlbHeader &header() const { return hdr; }
+	const uint8_t *data() const { return map; }
+	size_t size() const { return mapSize; }
+
+	// nullptr if index is out of range
+	Palette palette(size_t index) const;
+
+	// Offset of the first entry of the image list
+	size_t firstImage() const { return imageList; }
+
+	// Reads one layer at pos and advances pos past it (and past inline pixel
+	// data). These only ever read the mapping, so any number of threads may
+	// walk the same file with their own positions.
+	IlbResult readRecord(size_t &pos, IlbRecord &record) const;
+	IlbResult readImage(size_t &pos, IlbImage &image) const;
+
+	// Walks the whole image list once and fills index with one entry per
+	// image. Returns Ok, or Truncated if the list runs off the file.
+	IlbResult buildIndex(std::vector<IlbIndexEntry> &index) const;
+
+	// Appends where the image at pos keeps its pixel data: one extent per
+	// layer, inline in the record stream for v3, in the image directory
+	// for v4
+	IlbResult dataExtents(size_t pos, std::vector<IlbExtent> &extents) const;
+
+	// Sorts extents by offset and merges those that overlap or lie less
+	// than gap bytes apart, so reading them is one pass front to back
+	static void coalesce(std::vector<IlbExtent> &extents, size_t gap);
+
+	// Gets extent into the page cache: asks the kernel to start reading it,
+	// then touches it page by page in order, which only blocks the calling
+	// thread. Readers that get there first just fault the pages in.
+	void prefetch(const IlbExtent &extent) const;
+
+private:
+	int fd = -1;
+	const uint8_t *map = nullptr;
+	size_t mapSize = 0;
+
+	IlbHeader hdr = {};
+	std::vector<Palette> palettes;
+	size_t imageList = 0;
+
+	std::string lastError;
+};
+
+#endif
@@ -2,845 +2,1384 @@
 	ILB2PNG - Extracts images from an AoW1 ILB file and converts them to PNG
 */
 
-#include <array>
 #include <vector>
 #include <iostream>
+#include <sstream>
 #include <memory>
-#include <fstream>
+#include <cstring>
+#include <cstdlib>
 #include <filesystem>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ilb.h"
+#include "pipeline.h"
+#include "decode.h"
+#include "arena.h"
+#include "imgenc.h"
+#include "atlas.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+// The encoders allocate and free a lot per image, so they work out of a per
+// thread arena that is reset after every image
+static thread_local Arena encodeArena;
+
+// Stats of the image the calling decode thread is on, nullptr unless
+// --stats is given
+static thread_local ImageStats *imageStats = nullptr;
+
+// Every operator new ilb2png makes, so a run can show that converting
+// reaches a steady state without touching the heap
+static std::atomic<uint64_t> heapAllocations { 0 };
+
+// Every form of new and delete is replaced, so whatever the library picks
+// to allocate with, it is freed by the matching free
+static void *heapAlloc(size_t size, size_t align = 0)
+{
+	heapAllocations++;
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
-typedef std::array<char, 1024> Palette;
+	if (size == 0)
+		size = 1;
+	if (align <= alignof(std::max_align_t))
+		return malloc(size);
+	return aligned_alloc(align, (size + align - 1) / align * align);
+}
 
-void translate16(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent = 0xFFFFFFFF, uint32_t blend = 0);
-void translateRLE16(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent = 0xFFFFFFFF, uint32_t blend = 0);
-void translateRLE8(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, std::shared_ptr<Palette> pallete, uint32_t transparent, uint32_t mode);
+void *operator new(size_t size)
+{
+	if (void *p = heapAlloc(size))
+		return p;
+	throw std::bad_alloc();
+}
 
-struct Image
+void *operator new[](size_t size)
 {
-	size_t width;
-	size_t height;
-	size_t xoff;
-	size_t yoff;
-	uint8_t *data;
-	uint32_t mode;
-	std::string name;
+	return operator new(size);
+}
 
-	Image(size_t width, size_t height)
-	{
-		this->width = width;
-		this->height = height;
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return heapAlloc(size);
+}
 
-		this->data = new uint8_t[width * height * 4];
-		memset(this->data, 0, width * height * 4);
-	}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return heapAlloc(size);
+}
 
-	~Image()
-	{
-		delete[] data;
-	}
+void *operator new(size_t size, std::align_val_t align)
+{
+	if (void *p = heapAlloc(size, static_cast<size_t>(align)))
+		return p;
+	throw std::bad_alloc();
+}
 
-	void composite(std::shared_ptr<Image> other)
-	{
-		// I hope this.width >= other.width always holds true...
-		size_t thisOffset;
-		size_t otherOffset;
-		float sr = 0;
-		float sg = 0;
-		float sb = 0;
-		float sa = 0;
+void *operator new[](size_t size, std::align_val_t align)
+{
+	return operator new(size, align);
+}
 
-		float dr = 0;
-		float dg = 0;
-		float db = 0;
-		float da = 0;
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+	return heapAlloc(size, static_cast<size_t>(align));
+}
 
-		float inva = 0;
-		float outa = 0;
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+	return heapAlloc(size, static_cast<size_t>(align));
+}
 
-		for (size_t y = 0; y < other->height; ++y)
-		{
-			for (size_t x = 0; x < other->width; ++x)
-			{
-				thisOffset = 4 * (x + other->xoff) + (4 * (y + other->yoff) * this->width);
-				otherOffset = 4 * x + (4 * y * other->width);
-				
-				sr = other->data[otherOffset + 0];
-				sg = other->data[otherOffset + 1];
-				sb = other->data[otherOffset + 2];
-				sa = other->data[otherOffset + 3];
-
-				// Ignore completely transparent pixels
-				if (sa == 0)
-					continue;
+// Kept out of line so GCC doesn't pair the inlined free with the new
+// expression it deletes and warn about a mismatch
+[[gnu::noinline]] static void heapFree(void *p) noexcept
+{
+	free(p);
+}
 
-				// Don't bother with alpha for completely opaque pixels either
-				if (sa == 255)
-				{
-					this->data[thisOffset + 0] = (uint8_t)sr;
-					this->data[thisOffset + 1] = (uint8_t)sg;
-					this->data[thisOffset + 2] = (uint8_t)sb;
-					this->data[thisOffset + 3] = (uint8_t)sa;
-					continue;
-				}
+void operator delete(void *p) noexcept { heapFree(p); }
+void operator delete[](void *p) noexcept { heapFree(p); }
+void operator delete(void *p, size_t) noexcept { heapFree(p); }
+void operator delete[](void *p, size_t) noexcept { heapFree(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { heapFree(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { heapFree(p); }
+void operator delete(void *p, std::align_val_t) noexcept { heapFree(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { heapFree(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { heapFree(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { heapFree(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { heapFree(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { heapFree(p); }
+
+// Decode a layer into canvas and return it. With a base canvas the layer is
+// blended straight into base instead and nullptr is returned, unless it
+// doesn't fit, in which case it still goes to canvas.
+Image *readType8(const IlbFile &ilb, const IlbRecord &info, std::ostream &log, Image &canvas, Image *base = nullptr);
+Image *readType16(const IlbRecord &info, std::ostream &log, Image &canvas, bool sprite = false, bool isRLE = false, bool isTransparent = false, Image *base = nullptr);
+
+// Which images to convert; everything if both lists are empty
+struct Selection
+{
+	// Inclusive ID ranges
+	std::vector< std::pair<uint32_t, uint32_t> > ids;
+	// Shell style patterns matched against the image name
+	std::vector<std::string> names;
 
-				sr /= 255.0f;
-				sg /= 255.0f;
-				sb /= 255.0f;
-				sa /= 255.0f;
+	bool parseIDs(const char *list);
+	bool matches(const IlbIndexEntry &entry) const;
+};
 
-				inva = 1 - sa;
+// One input ILB and where its images go
+struct Source
+{
+	std::filesystem::path path;
+	// Subdirectory of the output root, empty if the files go straight there
+	std::string name;
+	IlbFile ilb;
+	std::vector<IlbIndexEntry> index;
+	IlbResult indexed = IlbResult::Ok;
+	Output *output = nullptr;
+	SubOutput subOutput;
+};
 
-				dr = this->data[thisOffset + 0] / 255.0f;
-				dg = this->data[thisOffset + 1] / 255.0f;
-				db = this->data[thisOffset + 2] / 255.0f;
-				da = this->data[thisOffset + 3] / 255.0f;
+// One selected image of one source
+struct WorkItem
+{
+	Source *source;
+	const IlbIndexEntry *row;
+};
 
-				outa = (sa + (da * inva));
+static std::filesystem::path directoryName(const std::filesystem::path &dir);
+static bool addInput(const std::filesystem::path &input, bool direct, std::vector<std::unique_ptr<Source>> &sources);
+bool decodeImage(const IlbFile &ilb, const IlbImage &entry, std::ostream &log, Image &image, bool fuseLayers = true);
+void runPipeline(const std::vector<WorkItem> &items, Output &root, const PipelineConfig &config);
+static void readPixelData(const IlbImage &entry, size_t headerBytes, ImageStats &stats);
+static bool parseSize(const char *text, uint64_t &size);
 
-				if (outa)
-				{
-					dr = (sr * sa + dr * da * inva) / outa;
-					dg = (sg * sa + dg * da * inva) / outa;
-					db = (sb * sa + db * da * inva) / outa;
-					da = outa;
-				}
-				else
-				{
-					dr = dg = db = 0;
-				}
+static void usage()
+{
+	std::cout << "Usage: ilb2png [options] <ilbfile|dir> [outdir]" << std::endl;
+	std::cout << "       ilb2png [options] -o <outdir> <ilbfile|dir>..." << std::endl;
+	std::cout << "  -o <outdir>       convert every input, each into outdir/<name of the ILB>" << std::endl;
+	std::cout << "  --id <list>       only convert these IDs, e.g. 412,413 or 400-420" << std::endl;
+	std::cout << "  --name <pattern>  only convert images whose name matches, e.g. 'Unit*'" << std::endl;
+	std::cout << "  -j <threads>      decode and encode on this many threads each, 0 for one per core" << std::endl;
+	std::cout << "  --decode-threads <n>, --encode-threads <n>, --write-threads <n>" << std::endl;
+	std::cout << "                    threads per pipeline stage, overriding -j" << std::endl;
+	std::cout << "  --queue-depth <n> images buffered between two pipeline stages (default 4)" << std::endl;
+	std::cout << "  --layer-buffers   decode every composite layer into its own canvas before blending" << std::endl;
+	std::cout << "  --png <preset>    store, fast, default or max PNG compression (default: default)" << std::endl;
+	std::cout << "  --format <fmt>    png, raw, qoi, tga or pam; all but png get a .json sidecar (default: png)" << std::endl;
+	std::cout << "  --atlas <size>    pack all images into size x size pages plus atlas.json instead" << std::endl;
+	std::cout << "  --archive <file>  write everything into one .tar or .zip instead of outdir, - for a tar on stdout" << std::endl;
+	std::cout << "  --stats[=json[:file]]" << std::endl;
+	std::cout << "                    report time and counts per image and in total at exit, as text or" << std::endl;
+	std::cout << "                    as JSON to stderr or file" << std::endl;
+	std::cout << "  --trace <file>    write a Chrome trace of every step of every image on every thread" << std::endl;
+	std::cout << "  --max-memory <n>  only start images while those in flight, plus every thread's reusable" << std::endl;
+	std::cout << "                    buffers, hold less than n bytes, e.g. 1536M or 2G" << std::endl;
+	std::cout << "  --no-io-uring     write files with one blocking call after another on the write threads" << std::endl;
+	std::cout << "  --no-readahead    don't read the selected pixel data in file order ahead of the decoders" << std::endl;
+}
 
-				this->data[thisOffset + 0] = (uint8_t)(dr * 255.0f);
-				this->data[thisOffset + 1] = (uint8_t)(dg * 255.0f);
-				this->data[thisOffset + 2] = (uint8_t)(db * 255.0f);
-				this->data[thisOffset + 3] = (uint8_t)(da * 255.0f);
+int main(int argc, char* *argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "id",   required_argument, nullptr, 'i' },
+		{ "name", required_argument, nullptr, 'n' },
+		{ "jobs", required_argument, nullptr, 'j' },
+		{ "decode-threads", required_argument, nullptr, 'D' },
+		{ "encode-threads", required_argument, nullptr, 'E' },
+		{ "write-threads",  required_argument, nullptr, 'W' },
+		{ "queue-depth",    required_argument, nullptr, 'Q' },
+		{ "layer-buffers",  no_argument,       nullptr, 'L' },
+		{ "png",            required_argument, nullptr, 'P' },
+		{ "format",         required_argument, nullptr, 'F' },
+		{ "atlas",          required_argument, nullptr, 'A' },
+		{ "archive",        required_argument, nullptr, 'R' },
+		{ "output",         required_argument, nullptr, 'o' },
+		{ "stats",          optional_argument, nullptr, 'S' },
+		{ "trace",          required_argument, nullptr, 'T' },
+		{ "max-memory",     required_argument, nullptr, 'M' },
+		{ "no-io-uring",    no_argument,       nullptr, 'U' },
+		{ "no-readahead",   no_argument,       nullptr, 'N' },
+		{ "help", no_argument,       nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	Selection selection;
+	PipelineConfig config;
+	unsigned threads = 1;
+	unsigned decodeThreads = 0;
+	unsigned encodeThreads = 0;
+	const char *archive = nullptr;
+	const char *outRoot = nullptr;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hj:o:", longOptions, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			if (!selection.parseIDs(optarg))
+			{
+				std::cerr << "[ERR ] Bad ID list: " << optarg << std::endl;
+				return -4;
+			}
+			break;
+		case 'n':
+			selection.names.push_back(optarg);
+			break;
+		case 'j':
+			threads = strtoul(optarg, nullptr, 0);
+			if (threads == 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+			break;
+		case 'D':
+			decodeThreads = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		case 'E':
+			encodeThreads = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		case 'W':
+			config.writeThreads = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		case 'Q':
+			config.queueDepth = std::max(1ul, strtoul(optarg, nullptr, 0));
+			break;
+		case 'L':
+			config.fuseLayers = false;
+			break;
+		case 'P':
+			if (!pngParsePreset(optarg, config.png))
+			{
+				std::cerr << "[ERR ] Unknown PNG preset: " << optarg << std::endl;
+				return -6;
+			}
+			break;
+		case 'F':
+			if (!parseOutputFormat(optarg, config.format))
+			{
+				std::cerr << "[ERR ] Unknown output format: " << optarg << std::endl;
+				return -7;
+			}
+			break;
+		case 'A':
+			config.atlasSize = strtoul(optarg, nullptr, 0);
+			if (config.atlasSize == 0)
+			{
+				std::cerr << "[ERR ] Bad atlas page size: " << optarg << std::endl;
+				return -8;
+			}
+			break;
+		case 'R':
+			archive = optarg;
+			break;
+		case 'o':
+			outRoot = optarg;
+			break;
+		case 'S':
+			config.stats = StatsFormat::Text;
+			if (optarg && !parseStatsFormat(optarg, config.stats, config.statsFile))
+			{
+				std::cerr << "[ERR ] Unknown stats format: " << optarg << std::endl;
+				return -10;
 			}
+			break;
+		case 'T':
+			config.trace = optarg;
+			break;
+		case 'M':
+			if (!parseSize(optarg, config.maxMemory))
+			{
+				std::cerr << "[ERR ] Bad memory size: " << optarg << std::endl;
+				return -11;
+			}
+			break;
+		case 'U':
+			config.ioUring = false;
+			break;
+		case 'N':
+			config.readahead = false;
+			break;
+		default:
+			usage();
+			return 0;
 		}
 	}
-};
-
-std::shared_ptr<Image> readType8(std::fstream &ilbFile, uint32_t imgDirectory, std::vector< std::shared_ptr<Palette> > &palettes);
-std::shared_ptr<Image> readType16(std::fstream &ilbFile, uint32_t imgDirectory, bool sprite = false, bool isRLE = false, bool isTransparent = false);
 
-int main(int argc, char* *argv)
-{
-	if (argc < 2)
+	if (optind >= argc)
 	{
-		std::cout << "Usage: ilb2png <ilbfile> [outdir]" << std::endl;
+		usage();
 		return 0;
 	}
 
-	std::filesystem::path ilbPath = argv[1];
-	std::filesystem::path outDir = "";
+	config.decodeThreads = decodeThreads ? decodeThreads : threads;
+	config.encodeThreads = encodeThreads ? encodeThreads : threads;
+
+	pngInit(config.png, config.encodeThreads);
 
-	if (argc < 3)
+	// Without -o there is one input and an output directory. A single ILB
+	// goes straight into that directory, which defaults to one named after
+	// it, like always; a directory's ILBs each get their own subdirectory,
+	// mirroring the tree.
+	std::vector<std::unique_ptr<Source>> sources;
+	std::filesystem::path outDir;
+	int result = 0;
+
+	if (outRoot)
 	{
-		outDir = std::filesystem::current_path();
-		outDir /= ilbPath.stem();
+		outDir = outRoot;
+
+		for (int i = optind; i < argc; ++i)
+			if (!addInput(argv[i], false, sources))
+				result = -1;
 	}
 	else
 	{
-		outDir = argv[2];
-	}
+		std::filesystem::path input = argv[optind];
 
-	if (!std::filesystem::is_regular_file(ilbPath))
-	{
-		std::cerr << "[ERR ] File does not exist: " << ilbPath.string() << std::endl;
-		return -1;
+		if (optind + 1 < argc)
+			outDir = argv[optind + 1];
+		else if (std::filesystem::is_directory(input))
+		{
+			// The default would be the input directory itself
+			std::cerr << "[ERR ] Converting a directory needs an output directory" << std::endl;
+			return -1;
+		}
+		else
+			outDir = std::filesystem::current_path() / input.stem();
+
+		if (!addInput(input, true, sources))
+			result = -1;
 	}
 
-	std::fstream ilbFile(ilbPath, std::fstream::in | std::fstream::binary);
+	if (sources.empty())
+		return result ? result : -1;
+
+	DirectoryOutput directory;
+	ArchiveOutput archiveOutput;
+	Output *output = &directory;
 
-	if (!std::filesystem::is_directory(outDir))
+	if (archive)
 	{
-		try
+		output = &archiveOutput;
+
+		if (!archiveOutput.open(archive))
 		{
-			std::filesystem::create_directories(outDir);
+			std::cerr << "[ERR ] " << archiveOutput.error() << std::endl;
+			return -2;
 		}
-		catch (std::filesystem::filesystem_error &e)
+
+		// The archive has its own copy of stdout, so point ours at stderr
+		// and every message stays out of the stream
+		if (strcmp(archive, "-") == 0)
 		{
-			std::cerr << "[ERR ] Failed to create output directory " << outDir.string() << ": " << e.what() << std::endl;
-			return -2;
+			std::cout.flush();
+			dup2(STDERR_FILENO, STDOUT_FILENO);
 		}
 	}
+	else if (!directory.open(outDir))
+	{
+		std::cerr << "[ERR ] " << directory.error() << std::endl;
+		return -2;
+	}
 
 	// If we're here, it should be good filesystem-wise from here on out.
-	uint32_t magic = 0;
-	// Magic should be 0x424C4904, or 0x04,'ILB'
-	ilbFile.read((char*)&magic, sizeof(uint32_t));
+	// Every input goes into the same pipeline, so a big ILB's images are
+	// spread over all threads instead of holding up the end of the batch.
+	std::vector<WorkItem> items;
 
-	// Unknown, seemingly useless value
-	uint32_t unkID = 0;
-	ilbFile.read((char*)&unkID, sizeof(uint32_t));
+	for (const std::unique_ptr<Source> &source : sources)
+	{
+		IlbFile &ilb = source->ilb;
 
-	// Float because idklol
-	float version = 0;
-	ilbFile.read((char*)&version, sizeof(float));
+		if (!ilb.open(source->path))
+		{
+			std::cerr << "[ERR ] " << ilb.error() << std::endl;
+			result = -3;
+			continue;
+		}
 
-	// Length of the header even though it doesn't change within versions
-	uint32_t headerLength = 0;
-	ilbFile.read((char*)&headerLength, sizeof(uint32_t));
+		if (source->name.empty())
+			source->output = output;
+		else if (source->subOutput.open(*output, source->name))
+			source->output = &source->subOutput;
+		else
+		{
+			std::cerr << "[ERR ] " << source->subOutput.error() << std::endl;
+			result = -2;
+			continue;
+		}
 
-	uint32_t imgDirectory = 0;
-	uint32_t fileSize = 0;
-	uint32_t paletteCount = 0;
+		std::cout << "Reading " << source->path.string() << " - ID " << ilb.header().unkID << std::endl;
 
-	if (version == 4.0f)
-	{
-		ilbFile.read((char*)&imgDirectory, sizeof(uint32_t));
-		ilbFile.read((char*)&fileSize, sizeof(uint32_t));
-	}
+		if(ilb.header().paletteCount != 1)
+			std::cout << "There are " << ilb.header().paletteCount << " palettes." << std::endl;
+		else
+			std::cout << "There  is 1 palette." << std::endl;
 
-	std::cout << "Reading " << ilbPath.string() << " - ID " << unkID << std::endl;
-	
-	ilbFile.read((char*)&paletteCount, sizeof(uint32_t));
+		// Now we have the image list. Index it from the record headers alone
+		// and only decode what was asked for.
+		source->indexed = ilb.buildIndex(source->index);
 
-	if(paletteCount != 1)
-		std::cout << "There are " << paletteCount << " palettes." << std::endl;
-	else
-		std::cout << "There  is 1 palette." << std::endl;
+		for (const IlbIndexEntry &row : source->index)
+			if (selection.matches(row))
+				items.push_back({ source.get(), &row });
+	}
 
-	std::vector< std::shared_ptr<Palette> > palettes;
-	uint32_t palType = 0;
-	for (size_t i = 0; i < paletteCount; ++i)
-	{
-		std::shared_ptr<Palette> palette = std::make_shared<Palette>();
-		palettes.push_back(palette);
+	runPipeline(items, *output, config);
 
-		ilbFile.read((char*)&palType, sizeof(uint32_t));
+	if (!output->finish())
+	{
+		std::cerr << "[ERR ] " << output->error() << std::endl;
+		return -9;
+	}
 
-		if (palType != 0x88801B18)
+	for (const std::unique_ptr<Source> &source : sources)
+	{
+		if (source->indexed == IlbResult::Truncated)
 		{
-			std::cerr << "[ERR ] Unknown palette type!" << std::endl;
-			return -3;
+			std::cerr << "Ran off the end of " << source->path.string() << "!" << std::endl;
+			result = -5;
 		}
-
-		// As far as anyone has been able to find, the palettes have only ever been
-		// r8g8b8x8
-		ilbFile.read((*palette).data(), 1024);
 	}
 
-	// Now we have the image list
-	uint32_t imageID = 0;
-	bool composite = false;
+	if (result)
+		return result;
 
-	do
-	{
-		std::shared_ptr<Image> image;
+	std::cout << "Done." << std::endl;
 
-		ilbFile.read((char*)&imageID, sizeof(uint32_t));
-		if (imageID == 0xFFFFFFFF)
-			break;
+	return 0;
+}
 
-		uint32_t type = 0;
-		do
-		{
-			std::shared_ptr<Image> layer;
+// Last component of a directory, even for ., .. or a trailing slash
+static std::filesystem::path directoryName(const std::filesystem::path &dir)
+{
+	std::filesystem::path path = std::filesystem::absolute(dir).lexically_normal();
+	if (!path.has_filename())
+		path = path.parent_path();
 
-			ilbFile.read((char*)&type, sizeof(uint32_t));
+	return path.filename();
+}
 
-			// If the type is 256, it's a composite image
-			// we still need the *actual* type though, so read that too
-			if (type == 256)
-			{
-				composite = true;
-				ilbFile.read((char*)&type, sizeof(uint32_t));
-			}
-			else
-			{
-				composite = false;
-			}
+static bool isIlb(const std::filesystem::path &path)
+{
+	std::string extension = path.extension().string();
+	return strcasecmp(extension.c_str(), ".ilb") == 0;
+}
 
-			if (type == 0xFFFFFFFF)
-			{
-				break;
-			}
+// Adds an ILB, or every ILB in a directory tree, to sources. A file goes
+// into a subdirectory named after it, the files of a directory into one
+// named after the directory, at their path relative to it. With direct the
+// outer subdirectory is left out.
+static bool addInput(const std::filesystem::path &input, bool direct, std::vector<std::unique_ptr<Source>> &sources)
+{
+	std::vector<std::pair<std::filesystem::path, std::filesystem::path>> found;
+	std::error_code ec;
 
-			std::cout << "Reading type " << type << " image for ID " << imageID << std::endl;
+	if (std::filesystem::is_regular_file(input))
+	{
+		found.emplace_back(input, direct ? std::filesystem::path() : input.stem());
+	}
+	else if (std::filesystem::is_directory(input))
+	{
+		std::filesystem::path base = direct ? std::filesystem::path() : directoryName(input);
 
-			switch (type)
-			{
-			case 0:
-				// Empty image
-				if (image)
-					std::cout << "End of composite image " << imageID << std::endl;
-				else
-					std::cout << "Empty Image." << std::endl;
-				break;
-			case 2:
-				layer = readType8(ilbFile, imgDirectory, palettes);
-				break;
-			case 16:
-				layer = readType16(ilbFile, imgDirectory);
-				break;
-			case 17:
-				layer = readType16(ilbFile, imgDirectory, true, true, false);
-				break;
-			case 18:
-				layer = readType16(ilbFile, imgDirectory, true, true, true);
-				break;
-			case 22:
-				layer = readType16(ilbFile, imgDirectory, true);
-				break;
-			default:
-				std::cout << "Unhandled type " << type << std::endl;
-				char end = 0;
-				char scan = 0;
-				do
-				{
-					ilbFile.read(&scan, 1);
-					if (ilbFile.eof())
-					{
-						std::cerr << "Ran off the end of the file!" << std::endl;
-						return -5;
-					}
+		for (std::filesystem::recursive_directory_iterator it(input, ec), end; !ec && it != end; it.increment(ec))
+			if (it->is_regular_file() && isIlb(it->path()))
+				found.emplace_back(it->path(), base / it->path().lexically_relative(input).replace_extension());
 
-					if (scan == -1)
-						end++;
-					else
-						end = 0;
+		if (ec)
+		{
+			std::cerr << "[ERR ] Failed to read directory " << input.string() << ": " << ec.message() << std::endl;
+			return false;
+		}
 
-				} while (end < 4);
-				type = 0xFFFFFFFF;
-			}
+		std::sort(found.begin(), found.end());
+	}
+	else
+	{
+		std::cerr << "[ERR ] File does not exist: " << input.string() << std::endl;
+		return false;
+	}
 
-			if (layer)
-			{
-				if (image)
-					image->composite(layer);
-				else
-				{
-					std::cout << "Image " << imageID << ": " << layer->name << " is " << layer->width << " x " << layer->height << " and has a blend mode of " << (layer->mode & 0x00FF) << ":" << ((layer->mode >> 8) & 0x00FF) << std::endl;
-					image = layer;
-				}
-			}
+	for (const auto &file : found)
+	{
+		std::string name = file.second.generic_string();
 
-		} while (type != 0xFFFFFFFF);
-		
-		if (image)
+		for (const std::unique_ptr<Source> &source : sources)
 		{
-			std::string filename = (outDir / (std::to_string(imageID) + ".png")).string();
-			std::cout << "Writing " << filename << std::endl;
-			stbi_write_png(filename.c_str(), image->width, image->height, 4, image->data, 4 * image->width);
+			if (source->name == name)
+			{
+				std::cerr << "[ERR ] " << file.first.string() << " and " << source->path.string() << " would both go to " << name << std::endl;
+				return false;
+			}
 		}
 
-	} while (!ilbFile.eof());
-
-	std::cout << "Done." << std::endl;
+		sources.push_back(std::make_unique<Source>());
+		sources.back()->path = file.first;
+		sources.back()->name = name;
+	}
 
-	return 0;
+	return true;
 }
 
-struct CommonInfo
+// A byte count with an optional K, M or G suffix, powers of 1024
+static bool parseSize(const char *text, uint64_t &size)
 {
-	char infoByte;
-	std::string imageName;
-	uint32_t width;
-	uint32_t height;
-	uint32_t xshift;
-	uint32_t yshift;
+	char *end = nullptr;
+	unsigned long long value = strtoull(text, &end, 0);
 
-	uint32_t subID;
+	if (end == text)
+		return false;
 
-	uint32_t size;
-	uint32_t offset;
+	switch (*end)
+	{
+	case 'g': case 'G':
+		value <<= 10;
+		[[fallthrough]];
+	case 'm': case 'M':
+		value <<= 10;
+		[[fallthrough]];
+	case 'k': case 'K':
+		value <<= 10;
+		end++;
+		break;
+	}
 
-	uint32_t totalW;
-	uint32_t totalH;
+	if (*end == 'i' || *end == 'B')
+		end += *end == 'i' && end[1] == 'B' ? 2 : 1;
 
-	uint32_t drawmode;
-	uint32_t blendValue;
+	if (*end || value == 0)
+		return false;
 
-	uint32_t colorset;
-};
+	size = value;
+	return true;
+}
 
-std::shared_ptr<CommonInfo> readCommonInfo(std::fstream &ilbFile, bool pal = false)
+bool Selection::parseIDs(const char *list)
 {
-	std::shared_ptr<CommonInfo> info = std::make_shared<CommonInfo>();
+	const char *p = list;
 
-	ilbFile.read(&info->infoByte, 1);
+	while (*p)
+	{
+		char *end = nullptr;
+		unsigned long first = strtoul(p, &end, 0);
+		unsigned long last = first;
 
-	uint32_t nameLength = 0;
-	ilbFile.read((char*)&nameLength, sizeof(uint32_t));
+		if (end == p)
+			return false;
 
-	char nameByte = 0;
-	for (uint32_t i = 0; i < nameLength; ++i)
-	{
-		ilbFile.read(&nameByte, 1);
-		info->imageName.append(1, nameByte);
-	}
+		p = end;
+		if (*p == '-')
+		{
+			last = strtoul(++p, &end, 0);
+			if (end == p || last < first)
+				return false;
+			p = end;
+		}
 
-	ilbFile.read((char*)&info->width, sizeof(uint32_t));
-	ilbFile.read((char*)&info->height, sizeof(uint32_t));
+		ids.emplace_back((uint32_t)first, (uint32_t)last);
 
-	ilbFile.read((char*)&info->xshift, sizeof(uint32_t));
-	ilbFile.read((char*)&info->yshift, sizeof(uint32_t));
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return false;
+	}
 
-	ilbFile.read((char*)&info->subID, sizeof(uint32_t));
+	return true;
+}
 
-	char unknownA = 0;
-	ilbFile.read(&unknownA, 1);
+bool Selection::matches(const IlbIndexEntry &entry) const
+{
+	if (ids.empty() && names.empty())
+		return true;
 
-	ilbFile.read((char*)&info->size, sizeof(uint32_t));
+	for (const auto &range : ids)
+		if (entry.id >= range.first && entry.id <= range.second)
+			return true;
 
-	info->offset = 0;
-	if (info->infoByte != 1)
-		ilbFile.read((char*)&info->offset, sizeof(uint32_t));
+	std::string name(entry.name);
+	for (const std::string &pattern : names)
+		if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+			return true;
 
-	ilbFile.read((char*)&info->totalW, sizeof(uint32_t));
-	ilbFile.read((char*)&info->totalH, sizeof(uint32_t));
+	return false;
+}
 
-	info->drawmode = 0;
-	info->blendValue = 0;
+// Encodes and writes the pages of a filled atlas, then its manifest
+static void writeAtlas(const Atlas &atlas, const ImageEncoder &encoder, Output &output, StageStats &encodeStats, StageStats &writeStats)
+{
+	char name[32];
 
-	if (pal)
-	{
-		char unknownB = 0;
-		ilbFile.read(&unknownB, 1);
-	}
-	
-	if (info->infoByte == 3)
+	for (size_t i = 0; i < atlas.pageCount(); ++i)
 	{
-		ilbFile.read((char*)&info->drawmode, sizeof(uint32_t));
-		ilbFile.read((char*)&info->blendValue, sizeof(uint32_t));
+		uint64_t start = pipelineNow();
+		const Image &page = atlas.page(i);
+		size_t size = 0;
+		const unsigned char *data;
+		{
+			TraceSpan span("encode", i);
+			data = encoder.encode(page, 16, encodeArena, size);
+		}
+
+		encodeStats.busyNs += pipelineNow() - start;
+		start = pipelineNow();
+
+		snprintf(name, sizeof name, "atlas%zu.%s", i, encoder.extension());
+		std::cout << "Writing " << output.location() << name << " (" << page.width << " x " << page.height << ")" << std::endl;
+
+		if (!data || !output.write(name, data, size))
+			std::cerr << "[ERR ] Failed to write " << output.location() << name << std::endl;
+
+		encodeArena.reset();
+		writeStats.busyNs += pipelineNow() - start;
 	}
 
-	ilbFile.read((char*)&info->colorset, sizeof(uint32_t));
-	
-	return info;
+	std::string manifest;
+	atlas.manifest(encoder.extension(), manifest);
+
+	if (!output.write("atlas.json", reinterpret_cast<const unsigned char*>(manifest.data()), manifest.size()))
+		std::cerr << "[ERR ] Failed to write " << output.location() << "atlas.json" << std::endl;
 }
 
-struct SpriteInfo
+// Everything one image carries from stage to stage. Jobs go back to a free
+// list once written, so their layer list, canvas, output, sidecar and log
+// buffers are reused by later images.
+struct Job
 {
-	uint32_t clipW;
-	uint32_t clipH;
-	uint32_t clipX;
-	uint32_t clipY;
-	uint32_t trans;
+	Source *source;
+	const IlbIndexEntry *row;
+	// Position in the work list, which is also its atlas slot
+	size_t slot;
+	IlbImage entry;
+	Image image;
+	bool hasImage = false;
+	// Bytes of the memory budget held by this job's buffers
+	uint64_t charged = 0;
+	ImageStats stats;
+	std::vector<unsigned char> encoded;
+	std::string sidecar;
+	// Where the files go relative to their directory fd, kept until an
+	// asynchronous write is done with them
+	std::string path;
+	std::string sidecarPath;
+	unsigned pendingFiles = 0;
+	uint64_t writeStart = 0;
+	JobLog log;
 };
 
-std::shared_ptr<SpriteInfo> readSpriteInfo(std::fstream &ilbFile)
-{
-	std::shared_ptr<SpriteInfo> info = std::make_shared<SpriteInfo>();
-
-	ilbFile.read((char*)&info->clipW, sizeof(uint32_t));
-	ilbFile.read((char*)&info->clipH, sizeof(uint32_t));
-
-	ilbFile.read((char*)&info->clipX, sizeof(uint32_t));
-	ilbFile.read((char*)&info->clipY, sizeof(uint32_t));
+typedef std::unique_ptr<Job> JobPtr;
 
-	ilbFile.read((char*)&info->trans, sizeof(uint32_t));
+// Files each write thread has in flight through io_uring
+static const unsigned UringDepth = 64;
 
-	return info;
-}
+// Largest gap between two pieces of pixel data that readahead reads through
+static const size_t ReadaheadGap = 64 * 1024;
 
-std::shared_ptr<Image> readType16(std::fstream &ilbFile, uint32_t imgDirectory, bool isSprite, bool isRLE, bool isTransparent)
+// Runs parse -> decode -> encode -> write with a bounded queue between each
+// pair of stages, so the encoder keeps going while the writer is blocked on
+// slow storage and vice versa. Images go in biggest first, whichever source
+// they are from, so every thread pulls from the same queues and the run
+// ends on a spread of small images rather than one huge one.
+void runPipeline(const std::vector<WorkItem> &items, Output &root, const PipelineConfig &config)
 {
-	std::shared_ptr<CommonInfo> info = readCommonInfo(ilbFile);
-	std::shared_ptr<SpriteInfo> sprite;
-	if (isSprite)
-		sprite = readSpriteInfo(ilbFile);
+	StageStats parseStats("parse");
+	StageStats decodeStats("decode");
+	StageStats encodeStats("encode");
+	StageStats writeStats("write");
 
-	uint32_t unknown = 0;
-	if (isRLE)
-		ilbFile.read((char*)&unknown, sizeof(uint32_t));
+	decodeStats.threads = config.decodeThreads;
+	encodeStats.threads = config.encodeThreads;
+	writeStats.threads = config.writeThreads;
 
-	// Here on out is type-specific
+	BoundedQueue<JobPtr> decodeQueue(config.queueDepth, 1);
+	BoundedQueue<JobPtr> encodeQueue(config.queueDepth, config.decodeThreads);
+	BoundedQueue<JobPtr> writeQueue(config.queueDepth, config.encodeThreads);
 
-	bool reseek = info->infoByte != 1;
+	FreeList<JobPtr> freeJobs;
+	RunStats runStats(config.stats != StatsFormat::None ? items.size() : 0);
+	const bool collect = config.stats != StatsFormat::None;
 
-	std::streampos oldpos = 0;
+	MemoryBudget budget(config.maxMemory);
 
-	if (reseek)
+	// What an image holds on to between parse and write: its pixel data,
+	// the canvas, and up to as much again each for the encoder's scratch
+	// memory and its output
+	auto footprint = [](const IlbIndexEntry &row)
 	{
-		oldpos = ilbFile.tellg();
-		ilbFile.seekg(info->offset + imgDirectory, std::fstream::beg);
-	}
-
-	// Read the image data
+		return row.size + 3 * 4 * (uint64_t)row.width * row.height;
+	};
+
+	// Every decode thread keeps a canvas for layers that can't be blended in
+	// place, and every encode thread its arena, for the whole run. Each
+	// grows to the biggest image it sees, scratch and output for the arena.
+	uint64_t biggest = 0;
+	for (const WorkItem &item : items)
+		biggest = std::max(biggest, 4 * (uint64_t)item.row->width * item.row->height);
+	budget.reserve((config.decodeThreads + 2 * config.encodeThreads) * biggest);
+
+	std::unique_ptr<Tracer> tracer;
+	if (!config.trace.empty())
+		tracer = std::make_unique<Tracer>();
+	std::mutex logMutex;
+	std::unique_ptr<ImageEncoder> encoder = makeImageEncoder(config.format, config.png);
+
+	// In atlas mode images are copied into their place on a page instead of
+	// being encoded, and the pages are encoded once everything is in
+	std::unique_ptr<Atlas> atlas;
+	if (config.atlasSize)
+	{
+		std::vector<const IlbIndexEntry*> rows;
+		for (const WorkItem &item : items)
+			rows.push_back(item.row);
 
-	char *imgData = new char[info->size];
-	ilbFile.read(imgData, info->size);
+		atlas = std::make_unique<Atlas>(config.atlasSize);
+		atlas->pack(rows);
 
-	std::shared_ptr<Image> img = std::make_shared<Image>(info->totalW, info->totalH);
-	img->xoff = info->xshift;
-	img->yoff = info->yshift;
-	img->name = info->imageName;
+		// The pages are there for the whole run
+		for (size_t i = 0; i < atlas->pageCount(); ++i)
+			budget.reserve(4 * (uint64_t)atlas->page(i).width * atlas->page(i).height);
+	}
 
-	if (isTransparent)
-		img->mode = 0x0001;
-	else
-		img->mode = info->drawmode;
+	std::vector<size_t> order(items.size());
+	for (size_t i = 0; i < items.size(); ++i)
+		order[i] = i;
 
-	switch (info->colorset)
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
 	{
-	case 0x56509310:
-		if (isSprite)
+		// Encoding, the bulk of the work, goes by canvas size
+		return (uint64_t)items[a].row->width * items[a].row->height > (uint64_t)items[b].row->width * items[b].row->height;
+	});
+
+	std::vector<std::thread> threads;
+
+	// Images are decoded biggest first, which jumps all over the file, and
+	// in v4 every image also jumps between its record and the image
+	// directory. So one thread reads the pixel data of everything selected
+	// in file order, merged into long runs, and the decoders mostly find it
+	// in the page cache instead of seeking for it.
+	if (config.readahead)
+	{
+		std::vector<std::pair<const Source*, std::vector<IlbExtent>>> extents;
+
+		for (const WorkItem &item : items)
 		{
-			if (isRLE)
-				translateRLE16(imgData, sprite->clipW, sprite->clipH, sprite->clipX, sprite->clipY, img->data, info->totalW, info->totalH, sprite->trans, info->drawmode | (info->blendValue << 16));
-			else
-				translate16(imgData, sprite->clipW, sprite->clipH, sprite->clipX, sprite->clipY, img->data, info->totalW, info->totalH, sprite->trans, info->drawmode | (info->blendValue << 16));
+			if (extents.empty() || extents.back().first != item.source)
+				extents.emplace_back(item.source, std::vector<IlbExtent>());
+
+			item.source->ilb.dataExtents(item.row->offset, extents.back().second);
 		}
-		else
-			translate16(imgData, info->width, info->height, info->xshift, info->yshift, img->data, info->totalW, info->totalH, 0xFFFFFFFF, info->drawmode | (info->blendValue << 16));
-		break;
-	default:
-		std::cout << "Unknown pixel format!";
+
+		threads.emplace_back([&tracer, extents = std::move(extents)]() mutable
+		{
+			if (tracer)
+				tracer->attach("readahead");
+
+			for (auto &source : extents)
+			{
+				// Reading past a gap this small is cheaper than a seek
+				IlbFile::coalesce(source.second, ReadaheadGap);
+
+				for (size_t i = 0; i < source.second.size(); ++i)
+				{
+					TraceSpan span("readahead", i);
+					source.first->ilb.prefetch(source.second[i]);
+				}
+			}
+		});
 	}
 
-	delete[] imgData;
+	// Allocation count once half of the images are out
+	const uint64_t half = items.size() / 2;
+	std::atomic<uint64_t> written { 0 };
+	std::atomic<uint64_t> allocationsAtHalf { heapAllocations.load() };
 
-	if (reseek)
+	threads.emplace_back([&]()
 	{
-		ilbFile.seekg(oldpos);
-	}
+		if (tracer)
+			tracer->attach("parse");
 
-	return img;
-}
+		for (size_t slot : order)
+		{
+			// Only start on the image once it fits in the budget. A job
+			// that comes back with big enough buffers costs nothing more,
+			// one with buffers too small to grow is dropped to make room.
+			uint64_t need = footprint(*items[slot].row);
+			JobPtr job;
 
-std::shared_ptr<Image> readType8(std::fstream &ilbFile, uint32_t imgDirectory, std::vector< std::shared_ptr<Palette> > &palettes)
-{
-	std::shared_ptr<CommonInfo> info = readCommonInfo(ilbFile, true);
-	std::shared_ptr<SpriteInfo> sprite = readSpriteInfo(ilbFile);
+			for (;;)
+			{
+				uint64_t seen = budget.state();
+
+				if (freeJobs.take(job))
+				{
+					if (job->charged >= need || budget.acquire(need - job->charged))
+					{
+						job->charged = std::max(job->charged, need);
+						break;
+					}
 
-	uint32_t unknown = 0;
-	ilbFile.read((char*)&unknown, sizeof(uint32_t));
+					uint64_t charged = job->charged;
+					job.reset();
+					budget.release(charged);
+					continue;
+				}
 
-	// Here on out is type-specific
+				if (budget.acquire(need))
+				{
+					job = std::make_unique<Job>();
+					job->charged = need;
+					break;
+				}
 
-	bool reseek = info->infoByte != 1;
+				budget.wait(seen, parseStats);
+			}
 
-	std::streampos oldpos = 0;
+			// Waiting for memory is a stall, not work
+			uint64_t start = pipelineNow();
 
-	if (reseek)
-	{
-		oldpos = ilbFile.tellg();
-		ilbFile.seekg(info->offset + imgDirectory, std::fstream::beg);
-	}
+			job->source = items[slot].source;
+			job->row = items[slot].row;
+			job->slot = slot;
+			job->stats.reset();
 
-	// Read the image data
+			size_t pos = job->row->offset;
+			{
+				TraceSpan span("parse", job->row->id);
+				StatTimer timer(collect ? &job->stats.parseNs : nullptr);
+				job->source->ilb.readImage(pos, job->entry);
+			}
 
-	char *imgData = new char[info->size];
-	ilbFile.read(imgData, info->size);
+			if (collect)
+				readPixelData(job->entry, pos - job->row->offset, job->stats);
 
-	std::shared_ptr<Image> img = std::make_shared<Image>(info->totalW, info->totalH);
-	img->xoff = info->xshift;
-	img->yoff = info->yshift;
-	img->name = info->imageName;
+			parseStats.busyNs += pipelineNow() - start;
+			parseStats.items++;
 
-	translateRLE8(imgData, sprite->clipW, sprite->clipH, sprite->clipX, sprite->clipY, img->data, info->totalW, info->totalH, palettes[info->colorset], sprite->trans, info->drawmode | (info->blendValue << 16));
+			decodeQueue.push(std::move(job), parseStats);
+		}
 
-	delete[] imgData;
+		decodeQueue.producerDone();
+	});
 
-	if (reseek)
+	for (unsigned t = 0; t < config.decodeThreads; ++t)
 	{
-		ilbFile.seekg(oldpos);
-	}
+		threads.emplace_back([&, t]()
+		{
+			JobPtr job;
 
-	return img;
-}
+			if (tracer)
+				tracer->attach("decode", t);
 
-void translate16(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent, uint32_t mode)
-{
-	uint16_t *data = static_cast<uint16_t*>(pixelData);
+			while (decodeQueue.pop(job, decodeStats))
+			{
+				uint64_t start = pipelineNow();
 
-	uint32_t pixel = 0;
-	uint8_t r = 0;
-	uint8_t g = 0;
-	uint8_t b = 0;
-	uint8_t a = 255;
+				imageStats = collect ? &job->stats : nullptr;
+				{
+					TraceSpan span("decode", job->entry.id);
+					job->hasImage = decodeImage(job->source->ilb, job->entry, job->log, job->image, config.fuseLayers);
+				}
+
+				if (collect && job->hasImage)
+					job->stats.countAlpha(job->image);
 
-	int show = mode & 0x00FF;
-	int blend = (mode >> 8) & 0x00FF;
-	bool doBlend = false;
+				decodeStats.busyNs += pipelineNow() - start;
+				decodeStats.items++;
 
-	if (show == 2 && blend == 1)
-		a = (((blend >> 16) & 0x00FF) * 255) / 100;
-	else if (show == 1)
-		a = 128;
+				encodeQueue.push(std::move(job), decodeStats);
+			}
+
+			encodeQueue.producerDone();
+		});
+	}
 
-	for (size_t y = 0; y < dataH; ++y)
+	for (unsigned t = 0; t < config.encodeThreads; ++t)
 	{
-		for (size_t x = 0; x < dataW; ++x)
+		threads.emplace_back([&, t]()
 		{
-			pixel = data[x + dataW*y];
-			size_t pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
+			JobPtr job;
 
-			if (pixel == transparent)
+			if (tracer)
+				tracer->attach("encode", t);
+
+			while (encodeQueue.pop(job, encodeStats))
 			{
-				pngData[pngPos + 0] = 0;
-				pngData[pngPos + 1] = 0;
-				pngData[pngPos + 2] = 0;
-				pngData[pngPos + 3] = 0;
-				continue;
-			}
+				uint64_t start = pipelineNow();
 
-			r = (((pixel >> 11) & 0x1F) * 255) / 31;
-			g = (((pixel >>  5) & 0x3F) * 255) / 63;
-			b = (((pixel >>  0) & 0x1F) * 255) / 31;
+				job->encoded.clear();
+				job->sidecar.clear();
 
-			if (show == 2 && (blend == 2 || blend == 3))
-			{
-				// Additive, just treat the general brightness as the alpha because lazy
-				a = (r + g + b) / 3;
+				if (job->hasImage && atlas)
+				{
+					TraceSpan span("place", job->entry.id);
 
-				// Super bright!
-				if (blend == 3)
+					if (!atlas->place(job->slot, job->source->name, job->entry.id, job->image))
+						job->log << "[ERR ] Image " << job->entry.id << (atlas->slots()[job->slot].packed ? " is not the size its index entry promised" : " could not be packed")
+							<< ", left out of the atlas" << std::endl;
+				}
+				else if (job->hasImage)
 				{
-					uint32_t brighta = (a * 175) / 100;
-					if (brighta > 255)
-						a = 255;
-					else
-						a = (uint8_t)brighta;
+					TraceSpan span("encode", job->entry.id);
+					Image &image = job->image;
+					size_t size = 0;
+					const unsigned char *data = encoder->encode(image, job->row->type, encodeArena, size);
+
+					if (data)
+					{
+						if (job->encoded.capacity() < size)
+							job->encoded.reserve(std::max(size, job->encoded.capacity() + job->encoded.capacity() / 2));
+						job->encoded.assign(data, data + size);
+					}
+
+					if (encoder->needsSidecar())
+						imageSidecar(image, job->entry.id, job->sidecar);
+
+					encodeArena.reset();
+					job->stats.outputBytes = job->encoded.size() + job->sidecar.size();
 				}
-			}
-			else if (show == 2 && blend == 4)
-			{
-				// Multiply, just do the inverse of the above
-				a = 255 - ((r + g + b) / 3);
+
+				job->stats.encodeNs = pipelineNow() - start;
+				encodeStats.busyNs += job->stats.encodeNs;
+				encodeStats.items++;
+
+				writeQueue.push(std::move(job), encodeStats);
 			}
 
-			pngData[pngPos + 0] = r;
-			pngData[pngPos + 1] = g;
-			pngData[pngPos + 2] = b;
-			pngData[pngPos + 3] = a;
-		}
+			writeQueue.producerDone();
+		});
 	}
-}
 
-void translateRLE16(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, uint32_t transparent, uint32_t mode)
-{
-	uint16_t *data = static_cast<uint16_t*>(pixelData);
+	// Everything after a job's files are out: its log, its stats, and back
+	// to the free list with it
+	auto retire = [&](JobPtr &job)
+	{
+		writeStats.items++;
 
-	uint32_t pixel = 0;
-	uint8_t r = 0;
-	uint8_t g = 0;
-	uint8_t b = 0;
-	uint8_t a = 255;
+		{
+			std::lock_guard<std::mutex> lock(logMutex);
+			std::cout.write(job->log.text().data(), job->log.text().size());
+			std::cout.flush();
+		}
 
-	int show = mode & 0x00FF;
-	int blend = (mode >> 8) & 0x00FF;
-	bool doBlend = false;
+		if (collect)
+			runStats.add(job->source->path.native(), job->entry.id, job->stats);
 
-	if (show == 2 && blend == 1)
-		a = (((blend >> 16) & 0x00FF) * 255) / 100;
-	else if (show == 1)
-		a = 128;
+		if (++written == half)
+			allocationsAtHalf = heapAllocations.load();
 
-	size_t offset = 0;
-	for (size_t y = 0; y < dataH; ++y)
-	{
-		uint32_t scanSize = data[offset];
-		offset++;
-		scanSize |= data[offset] << 16;
-		offset++;
+		job->log.reset();
+		freeJobs.give(std::move(job));
+		budget.notify();
+	};
 
-		scanSize /= 2;
+	// Plain files can go through io_uring, archives can't
+	std::string probe;
+	const bool ioUring = config.ioUring && root.resolve("", probe) >= 0;
 
-		if (scanSize & 0x01)
-			scanSize++;
+	for (unsigned t = 0; t < config.writeThreads; ++t)
+	{
+		threads.emplace_back([&, t]()
+		{
+			JobPtr job;
 
-		scanSize-=2;
+			if (tracer)
+				tracer->attach("write", t);
 
-		size_t x = 0;
-		bool wasTransparent = false;
-		
-		for (size_t i = 0; i < scanSize; ++i)
-		{
-			pixel = data[offset + i];
-			size_t pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
+			// Each write thread keeps a ring's worth of files in flight and
+			// only blocks on the queue once all of them are done
+			UringWriter uring;
 
-			if (wasTransparent)
+			// Writes a job's files with blocking calls
+			auto writeFiles = [&](Job &job)
 			{
-				size_t count = pixel / 2;
-				for (size_t j = 0; j < count; ++j)
-				{
-					pngData[pngPos + 0] = 0;
-					pngData[pngPos + 1] = 0;
-					pngData[pngPos + 2] = 0;
-					pngData[pngPos + 3] = 0;
-					x++;
-					pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
-				}
+				char name[32];
+				snprintf(name, sizeof name, "%u.%s", job.entry.id, encoder->extension());
 
-				wasTransparent = false;
-				continue;
-			}
+				Output &output = *job.source->output;
 
-			if (pixel == transparent)
-			{
-				if ((i + 1) < scanSize)
+				if (!output.write(name, job.encoded.data(), job.encoded.size()))
+					job.log << "[ERR ] Failed to write " << output.location() << name << std::endl;
+
+				if (!job.sidecar.empty())
 				{
-					wasTransparent = true;
+					snprintf(name, sizeof name, "%u.json", job.entry.id);
+
+					if (!output.write(name, reinterpret_cast<const unsigned char*>(job.sidecar.data()), job.sidecar.size()))
+						job.log << "[ERR ] Failed to write " << output.location() << name << std::endl;
 				}
-				else
+			};
+
+			if (ioUring && uring.open(UringDepth))
+			{
+				std::vector<JobPtr> inFlight;
+				std::vector<std::pair<void*, bool>> done;
+				bool ringOk = true;
+
+				inFlight.reserve(UringDepth);
+				done.reserve(UringDepth);
+
+				while (ringOk)
 				{
-					pngData[pngPos + 0] = 0;
-					pngData[pngPos + 1] = 0;
-					pngData[pngPos + 2] = 0;
-					pngData[pngPos + 3] = 0;
-					x++;
-					pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
+					// Room for an image and its sidecar
+					bool got = inFlight.empty() ? writeQueue.pop(job, writeStats) : uring.pending() + 2 <= UringDepth && writeQueue.tryPop(job);
+					if (!got && inFlight.empty())
+						break;
+
+					uint64_t start = pipelineNow();
+
+					if (got)
+					{
+						job->writeStart = start;
+						job->pendingFiles = 0;
+
+						if (!job->encoded.empty())
+						{
+							char name[32];
+							snprintf(name, sizeof name, "%u.%s", job->entry.id, encoder->extension());
+
+							Output &output = *job->source->output;
+							job->log << "Writing " << output.location() << name << std::endl;
+
+							// Files are tagged with their job, the low bit set
+							// for the sidecar
+							int dirfd = output.resolve(name, job->path);
+							uring.submit(dirfd, job->path.c_str(), job->encoded.data(), job->encoded.size(), job.get());
+							job->pendingFiles++;
+
+							if (!job->sidecar.empty())
+							{
+								snprintf(name, sizeof name, "%u.json", job->entry.id);
+
+								dirfd = output.resolve(name, job->sidecarPath);
+								uring.submit(dirfd, job->sidecarPath.c_str(), reinterpret_cast<const unsigned char*>(job->sidecar.data()), job->sidecar.size(),
+									reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(job.get()) | 1));
+								job->pendingFiles++;
+							}
+						}
+
+						if (job->pendingFiles)
+							inFlight.push_back(std::move(job));
+						else
+							retire(job);
+					}
+
+					// Sleep on the ring only if the queue had nothing
+					ringOk = uring.reap(done, !got);
+
+					for (const auto &file : done)
+					{
+						uintptr_t tag = reinterpret_cast<uintptr_t>(file.first);
+						Job &finished = *reinterpret_cast<Job*>(tag & ~uintptr_t(1));
+
+						if (!file.second)
+							finished.log << "[ERR ] Failed to write " << root.location() << (tag & 1 ? finished.sidecarPath : finished.path) << std::endl;
+
+						if (--finished.pendingFiles == 0)
+						{
+							finished.stats.writeNs = pipelineNow() - finished.writeStart;
+
+							if (traceBuffer)
+								traceBuffer->events.push_back({ "write", finished.entry.id, finished.writeStart, pipelineNow() });
+
+							auto it = std::find_if(inFlight.begin(), inFlight.end(), [&](const JobPtr &j) { return j.get() == &finished; });
+							assert(it != inFlight.end());
+
+							retire(*it);
+							inFlight.erase(it);
+						}
+					}
+
+					done.clear();
+
+					// Without a ring nothing in flight ever comes back, so it
+					// is all written again the plain way and the rest of the
+					// queue goes through the blocking loop below
+					if (!ringOk)
+					{
+						uring.close();
+
+						for (JobPtr &stuck : inFlight)
+						{
+							writeFiles(*stuck);
+							stuck->stats.writeNs = pipelineNow() - stuck->writeStart;
+							retire(stuck);
+						}
+
+						inFlight.clear();
+					}
+
+					writeStats.busyNs += pipelineNow() - start;
 				}
 
-				continue;
+				if (ringOk)
+					return;
 			}
 
-			r = (((pixel >> 11) & 0x1F) * 255) / 31;
-			g = (((pixel >> 5) & 0x3F) * 255) / 63;
-			b = (((pixel >> 0) & 0x1F) * 255) / 31;
-
-			if (show == 2 && (blend == 2 || blend == 3))
+			while (writeQueue.pop(job, writeStats))
 			{
-				// Additive, just treat the general brightness as the alpha because lazy
-				a = (r + g + b) / 3;
+				uint64_t start = pipelineNow();
 
-				// Super bright!
-				if (blend == 3)
+				if (!job->encoded.empty())
 				{
-					uint32_t brighta = (a * 175) / 100;
-					if (brighta > 255)
-						a = 255;
-					else
-						a = (uint8_t)brighta;
+					TraceSpan span("write", job->entry.id);
+					char name[32];
+					snprintf(name, sizeof name, "%u.%s", job->entry.id, encoder->extension());
+
+					job->log << "Writing " << job->source->output->location() << name << std::endl;
+					writeFiles(*job);
 				}
+
+				job->stats.writeNs = pipelineNow() - start;
+				writeStats.busyNs += job->stats.writeNs;
+
+				retire(job);
 			}
-			else if (show == 2 && blend == 4)
-			{
-				// Multiply, just do the inverse of the above
-				a = 255 - ((r + g + b) / 3);
-			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	if (atlas)
+	{
+		if (tracer)
+			tracer->attach("main");
+
+		writeAtlas(*atlas, *encoder, root, encodeStats, writeStats);
+		traceBuffer = nullptr;
+	}
 
-			pngData[pngPos + 0] = r;
-			pngData[pngPos + 1] = g;
-			pngData[pngPos + 2] = b;
-			pngData[pngPos + 3] = a;
+	if (tracer)
+	{
+		std::string error;
+		if (!tracer->write(config.trace.c_str(), error))
+			std::cerr << "[ERR ] " << error << std::endl;
+	}
 
-			x++;
+	// The JSON stats carry the stages themselves
+	if (config.stats == StatsFormat::Text)
+	{
+		std::cout << "Stage   threads  images    busy(s)  starved(s)  stalled(s)" << std::endl;
+		for (const StageStats *stats : { &parseStats, &decodeStats, &encodeStats, &writeStats })
+		{
+			char line[128];
+			snprintf(line, sizeof line, "%-7s %7u %7llu %10.3f %7.3f/%-4llu %7.3f/%-4llu",
+				stats->name, stats->threads, (unsigned long long)stats->items.load(), stats->busyNs / 1e9,
+				stats->inputWaitNs / 1e9, (unsigned long long)stats->inputWaits.load(),
+				stats->outputWaitNs / 1e9, (unsigned long long)stats->outputWaits.load());
+			std::cout << line << std::endl;
 		}
 
-		offset += scanSize;
+		std::cout << "Heap allocations: " << heapAllocations << ", " << (heapAllocations - allocationsAtHalf) << " of them after image " << half << " of " << items.size() << std::endl;
+	}
+
+	if (config.maxMemory)
+	{
+		char line[96];
+		snprintf(line, sizeof line, "Peak image memory: %.1f MiB of %.1f MiB", budget.highWater() / 1048576.0, config.maxMemory / 1048576.0);
+		std::cout << line << std::endl;
+	}
+
+	if (config.stats == StatsFormat::Text)
+		runStats.report(std::cout, config.stats, { &parseStats, &decodeStats, &encodeStats, &writeStats });
+	else if (collect && config.statsFile.empty())
+		runStats.report(std::cerr, config.stats, { &parseStats, &decodeStats, &encodeStats, &writeStats });
+	else if (collect)
+	{
+		std::ostringstream json;
+		runStats.report(json, config.stats, { &parseStats, &decodeStats, &encodeStats, &writeStats });
+
+		const std::string text = json.str();
+		if (!writeFile(config.statsFile.c_str(), reinterpret_cast<const unsigned char*>(text.data()), text.size()))
+			std::cerr << "[ERR ] Failed to write stats " << config.statsFile << std::endl;
 	}
 }
 
-void translateRLE8(void *pixelData, size_t dataW, size_t dataH, size_t xoff, size_t yoff, uint8_t* pngData, size_t pngW, size_t pngH, std::shared_ptr<Palette> pallete, uint32_t transparent, uint32_t mode)
+// Touches every page of the image's pixel data, so the page faults of the
+// mapping count as reading rather than as decoding. headerBytes is how much
+// of the record stream the image took up, inline pixel data included.
+static void readPixelData(const IlbImage &entry, size_t headerBytes, ImageStats &stats)
 {
-	uint8_t *data = static_cast<uint8_t*>(pixelData);
+	StatTimer timer(&stats.readNs);
+	uint8_t sum = 0;
+
+	stats.bytesRead += headerBytes;
 
-	uint32_t pixel = 0;
-	uint8_t r = 0;
-	uint8_t g = 0;
-	uint8_t b = 0;
-	uint8_t a = 255;
+	for (const IlbRecord &record : entry.layers)
+	{
+		if (!record.data)
+			continue;
 
-	int show = mode & 0x00FF;
-	int blend = (mode >> 8) & 0x00FF;
-	bool doBlend = false;
+		for (size_t i = 0; i < record.size; i += 4096)
+			sum += *(volatile const uint8_t*)(record.data + i);
 
-	if (show == 2 && blend == 1)
-		a = (((blend >> 16) & 0x00FF) * 255) / 100;
-	else if (show == 1)
-		a = 128;
+		if (record.infoByte != 1)
+			stats.bytesRead += record.size;
+	}
 
-	size_t offset = 0;
-	for (size_t y = 0; y < dataH; ++y)
-	{
-		uint32_t scanSize = data[offset];
-		offset++;
-		scanSize |= data[offset] << 8;
-		offset++;
-		scanSize |= data[offset] << 16;
-		offset++;
-		scanSize |= data[offset] << 24;
-		offset++;
+	(void)sum;
+}
+
+bool decodeImage(const IlbFile &ilb, const IlbImage &entry, std::ostream &log, Image &image, bool fuseLayers)
+{
+	// Canvas for layers that can't be blended straight into the image
+	static thread_local Image layerBuffer;
 
-		scanSize;
+	bool hasImage = false;
+	uint32_t imageID = entry.id;
 
-/*		if (scanSize & 0x01)
-			scanSize++;*/
+	for (const IlbRecord &record : entry.layers)
+	{
+		Image *layer = nullptr;
+		Image &canvas = hasImage ? layerBuffer : image;
+		Image *base = hasImage && fuseLayers ? &image : nullptr;
 
-		scanSize -= 4;
+		log << "Reading type " << record.type << " image for ID " << imageID << std::endl;
 
-		size_t x = 0;
-		bool wasTransparent = false;
+		// Later layers are blended onto the first, either while they are
+		// decoded or by Image::composite below
+		TraceSpan span(hasImage ? "composite" : "layer", imageID);
 
-		for (size_t i = 0; i < scanSize; ++i)
+		switch (record.type)
 		{
-			pixel = data[offset + i];
-			size_t pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
+		case 0:
+			// Empty image
+			if (hasImage)
+				log << "End of composite image " << imageID << std::endl;
+			else
+				log << "Empty Image." << std::endl;
+			break;
+		case 2:
+			layer = readType8(ilb, record, log, canvas, base);
+			break;
+		case 16:
+			layer = readType16(record, log, canvas, false, false, false, base);
+			break;
+		case 17:
+			layer = readType16(record, log, canvas, true, true, false, base);
+			break;
+		case 18:
+			layer = readType16(record, log, canvas, true, true, true, base);
+			break;
+		case 22:
+			layer = readType16(record, log, canvas, true, false, false, base);
+			break;
+		default:
+			log << "Unhandled type " << record.type << std::endl;
+		}
 
-			if (wasTransparent)
+		if (layer)
+		{
+			if (hasImage)
 			{
-				size_t count = pixel;
-				for (size_t j = 0; j < count; ++j)
-				{
-					pngData[pngPos + 0] = 0;
-					pngData[pngPos + 1] = 0;
-					pngData[pngPos + 2] = 0;
-					pngData[pngPos + 3] = 0;
-					x++;
-					pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
-				}
+				StatTimer timer(imageStats ? &imageStats->compositeNs : nullptr);
+				image.composite(*layer);
 
-				wasTransparent = false;
-				continue;
+				if (imageStats)
+					imageStats->compositeCalls++;
 			}
-
-			if (pixel == transparent)
+			else
 			{
-				if ((i + 1) < scanSize)
-				{
-					wasTransparent = true;
-				}
-				else
-				{
-					pngData[pngPos + 0] = 0;
-					pngData[pngPos + 1] = 0;
-					pngData[pngPos + 2] = 0;
-					pngData[pngPos + 3] = 0;
-					x++;
-					pngPos = (4 * (x + xoff)) + (4 * (y + yoff) * pngW);
-				}
-
-				continue;
+				log << "Image " << imageID << ": " << layer->name << " is " << layer->width << " x " << layer->height << " and has a blend mode of " << (layer->mode & 0x00FF) << ":" << ((layer->mode >> 8) & 0x00FF) << std::endl;
+				hasImage = true;
 			}
+		}
+	}
 
-			r = (*pallete)[4 * pixel + 0];
-			g = (*pallete)[4 * pixel + 1];
-			b = (*pallete)[4 * pixel + 2];
+	return hasImage;
+}
 
-			if (show == 2 && (blend == 2 || blend == 3))
-			{
-				// Additive, just treat the general brightness as the alpha because lazy
-				a = (r + g + b) / 3;
+// Blank canvas for one layer, placed at the layer's shift
+static Image *layerCanvas(const IlbRecord &info, Image &canvas)
+{
+	canvas.reset(info.totalW, info.totalH);
+	canvas.xoff = info.xshift;
+	canvas.yoff = info.yshift;
+	canvas.name = info.name;
+	canvas.mode = info.drawmode;
 
-				// Super bright!
-				if (blend == 3)
-				{
-					uint32_t brighta = (a * 175) / 100;
-					if (brighta > 255)
-						a = 255;
-					else
-						a = (uint8_t)brighta;
-				}
-			}
-			else if (show == 2 && blend == 4)
-			{
-				// Multiply, just do the inverse of the above
-				a = 255 - ((r + g + b) / 3);
-			}
+	return &canvas;
+}
 
-			pngData[pngPos + 0] = r;
-			pngData[pngPos + 1] = g;
-			pngData[pngPos + 2] = b;
-			pngData[pngPos + 3] = a;
+// Decodes a layer into canvas, or blends it straight into base when its
+// whole canvas fits there. Image::composite would place layer pixel x, y at
+// x + xshift, y + yshift on the base, so that is where it goes.
+static Image *decodeLayer(const IlbRecord &info, Image &canvas, Image *base, PixelLayout layout, size_t dataW, size_t dataH, size_t x, size_t y, uint32_t transparent, Palette palette = nullptr)
+{
+	uint32_t mode = info.drawmode | (info.blendValue << 16);
+	bool fused = base
+		&& x + dataW <= info.totalW && y + dataH <= info.totalH
+		&& (size_t)info.xshift + info.totalW <= base->width && (size_t)info.yshift + info.totalH <= base->height;
 
-			x++;
-		}
+	// A fused layer is composited as it is decoded, so it counts as a
+	// composite rather than a translate
+	StatTimer timer(imageStats ? (fused ? &imageStats->compositeNs : &imageStats->translateNs) : nullptr);
+
+	if (imageStats)
+	{
+		(fused ? imageStats->compositeCalls : imageStats->translateCalls)++;
+		imageStats->fusedLayers += fused;
+		imageStats->pixels += dataW * dataH;
+	}
+
+	if (fused)
+	{
+		translateOver(layout, info.data, info.data ? info.size : 0, dataW, dataH, x + info.xshift, y + info.yshift, base->data, base->width, base->height, transparent, mode, palette);
+		return nullptr;
+	}
+
+	Image *img = layerCanvas(info, canvas);
+
+	translate(layout, info.data, info.data ? info.size : 0, dataW, dataH, x, y, img->data, info.totalW, info.totalH, transparent, mode, palette);
+
+	return img;
+}
+
+Image *readType16(const IlbRecord &info, std::ostream &log, Image &canvas, bool isSprite, bool isRLE, bool isTransparent, Image *base)
+{
+	Image *img = nullptr;
+
+	switch (info.colorset)
+	{
+	case ILB_PIXEL_565:
+		if (isSprite)
+			img = decodeLayer(info, canvas, base, isRLE ? LAYOUT_RLE16 : LAYOUT_RAW16, info.clipW, info.clipH, info.clipX, info.clipY, info.trans);
+		else
+			img = decodeLayer(info, canvas, base, LAYOUT_RAW16, info.width, info.height, info.xshift, info.yshift, 0xFFFFFFFF);
+		break;
+	default:
+		log << "Unknown pixel format!";
+		// Still an (empty) layer, which only matters if it is the first
+		if (!base)
+			img = layerCanvas(info, canvas);
+	}
+
+	if (img && isTransparent)
+		img->mode = 0x0001;
 
-		offset += scanSize;
+	return img;
+}
+
+Image *readType8(const IlbFile &ilb, const IlbRecord &info, std::ostream &log, Image &canvas, Image *base)
+{
+	Palette palette = ilb.palette(info.colorset);
+	if (!palette)
+	{
+		log << "Palette number out of range!" << std::endl;
+		return nullptr;
 	}
+
+	return decodeLayer(info, canvas, base, LAYOUT_RLE8, info.clipW, info.clipH, info.clipX, info.clipY, info.trans, palette);
 }
@@ -0,0 +1,348 @@
+/*
+	Output formats for ilb2png
+*/
+
+#include "imgenc.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+	void put32BE(uint8_t *p, uint32_t v)
+	{
+		p[0] = v >> 24;
+		p[1] = v >> 16;
+		p[2] = v >> 8;
+		p[3] = v;
+	}
+
+	void put16LE(uint8_t *p, uint16_t v)
+	{
+		p[0] = v;
+		p[1] = v >> 8;
+	}
+
+	class PngEncoder : public ImageEncoder
+	{
+	public:
+		explicit PngEncoder(PngPreset preset) : preset(preset) {}
+
+		const char *extension() const override { return "png"; }
+		bool needsSidecar() const override { return false; }
+
+		const unsigned char *encode(const Image &image, uint32_t type, Arena &arena, size_t &size) const override
+		{
+			return pngEncode(image.data, image.width, image.height, preset, filterFor(type), arena, size);
+		}
+
+	private:
+		// Filter the fast encoder uses for an image, by the type of its first
+		// layer. RLE sprites are mostly transparent runs that compress best
+		// left alone, pictures are smooth enough to gain from predicting off
+		// the row above.
+		static PngFilter filterFor(uint32_t type)
+		{
+			switch (type)
+			{
+			case 2:
+			case 17:
+			case 18:
+				return PNG_FILTER_NONE;
+			default:
+				return PNG_FILTER_UP;
+			}
+		}
+
+		PngPreset preset;
+	};
+
+	class RawEncoder : public ImageEncoder
+	{
+	public:
+		const char *extension() const override { return "rgba"; }
+
+		// The canvas already is the file
+		const unsigned char *encode(const Image &image, uint32_t, Arena &, size_t &size) const override
+		{
+			size = 4 * image.width * image.height;
+			return image.data;
+		}
+	};
+
+	// See https://qoiformat.org/qoi-specification.pdf
+	class QoiEncoder : public ImageEncoder
+	{
+	public:
+		const char *extension() const override { return "qoi"; }
+
+		const unsigned char *encode(const Image &image, uint32_t, Arena &arena, size_t &size) const override
+		{
+			size_t count = image.width * image.height;
+
+			if (image.width > UINT32_MAX || image.height > UINT32_MAX)
+				return nullptr;
+
+			// Header, at worst 5 bytes per pixel, end marker
+			uint8_t *out = static_cast<uint8_t*>(arena.alloc(14 + 5 * count + 8));
+			uint8_t *o = out;
+
+			memcpy(o, "qoif", 4);
+			put32BE(o + 4, image.width);
+			put32BE(o + 8, image.height);
+			o[12] = 4; // RGBA
+			o[13] = 0; // sRGB with linear alpha
+			o += 14;
+
+			uint32_t index[64] = {};
+			uint8_t prev[4] = { 0, 0, 0, 255 };
+			uint32_t prevValue;
+			unsigned run = 0;
+
+			memcpy(&prevValue, prev, 4);
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				const uint8_t *px = image.data + 4 * i;
+				uint32_t value;
+				memcpy(&value, px, 4);
+
+				if (value == prevValue)
+				{
+					if (++run == 62 || i == count - 1)
+					{
+						*o++ = 0xC0 | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+
+				if (run)
+				{
+					*o++ = 0xC0 | (run - 1);
+					run = 0;
+				}
+
+				unsigned slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63;
+
+				if (index[slot] == value)
+				{
+					*o++ = slot;
+				}
+				else
+				{
+					index[slot] = value;
+
+					if (px[3] == prev[3])
+					{
+						int8_t dr = px[0] - prev[0];
+						int8_t dg = px[1] - prev[1];
+						int8_t db = px[2] - prev[2];
+						int8_t drg = dr - dg;
+						int8_t dbg = db - dg;
+
+						if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+						{
+							*o++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+						}
+						else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+						{
+							*o++ = 0x80 | (dg + 32);
+							*o++ = (drg + 8) << 4 | (dbg + 8);
+						}
+						else
+						{
+							*o++ = 0xFE;
+							*o++ = px[0];
+							*o++ = px[1];
+							*o++ = px[2];
+						}
+					}
+					else
+					{
+						*o++ = 0xFF;
+						memcpy(o, px, 4);
+						o += 4;
+					}
+				}
+
+				memcpy(prev, px, 4);
+				prevValue = value;
+			}
+
+			static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+			memcpy(o, end, 8);
+			o += 8;
+
+			size = o - out;
+			return out;
+		}
+	};
+
+	class TgaEncoder : public ImageEncoder
+	{
+	public:
+		const char *extension() const override { return "tga"; }
+
+		const unsigned char *encode(const Image &image, uint32_t, Arena &arena, size_t &size) const override
+		{
+			if (image.width > 0xFFFF || image.height > 0xFFFF)
+				return nullptr;
+
+			size_t count = image.width * image.height;
+			uint8_t *out = static_cast<uint8_t*>(arena.alloc(18 + 4 * count));
+
+			memset(out, 0, 18);
+			out[2] = 2; // uncompressed true colour
+			put16LE(out + 12, image.width);
+			put16LE(out + 14, image.height);
+			out[16] = 32;
+			out[17] = 0x28; // 8 alpha bits, first row at the top
+
+			// BGRA
+			const uint8_t *src = image.data;
+			uint8_t *dst = out + 18;
+
+			for (size_t i = 0; i < count; ++i, src += 4, dst += 4)
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+				dst[3] = src[3];
+			}
+
+			size = 18 + 4 * count;
+			return out;
+		}
+	};
+
+	class PamEncoder : public ImageEncoder
+	{
+	public:
+		const char *extension() const override { return "pam"; }
+
+		const unsigned char *encode(const Image &image, uint32_t, Arena &arena, size_t &size) const override
+		{
+			char header[128];
+			int length = snprintf(header, sizeof header, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", image.width, image.height);
+			size_t bytes = 4 * image.width * image.height;
+			uint8_t *out = static_cast<uint8_t*>(arena.alloc(length + bytes));
+
+			memcpy(out, header, length);
+			memcpy(out + length, image.data, bytes);
+
+			size = length + bytes;
+			return out;
+		}
+	};
+}
+
+bool parseOutputFormat(const char *name, OutputFormat &format)
+{
+	static const struct { const char *name; OutputFormat format; } formats[] =
+	{
+		{ "png", OutputFormat::Png },
+		{ "raw", OutputFormat::Raw },
+		{ "qoi", OutputFormat::Qoi },
+		{ "tga", OutputFormat::Tga },
+		{ "pam", OutputFormat::Pam }
+	};
+
+	for (const auto &f : formats)
+	{
+		if (strcmp(name, f.name) == 0)
+		{
+			format = f.format;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::unique_ptr<ImageEncoder> makeImageEncoder(OutputFormat format, PngPreset preset)
+{
+	switch (format)
+	{
+	case OutputFormat::Raw:
+		return std::make_unique<RawEncoder>();
+	case OutputFormat::Qoi:
+		return std::make_unique<QoiEncoder>();
+	case OutputFormat::Tga:
+		return std::make_unique<TgaEncoder>();
+	case OutputFormat::Pam:
+		return std::make_unique<PamEncoder>();
+	default:
+		return std::make_unique<PngEncoder>(preset);
+	}
+}
+
+// Length of the well formed UTF-8 sequence text starts with, 0 if it isn't
+// one
+static size_t utf8Length(std::string_view text)
+{
+	unsigned char c = text[0];
+	size_t length = c >= 0xF0 && c <= 0xF4 ? 4 : c >= 0xE0 ? 3 : c >= 0xC2 && c < 0xE0 ? 2 : 0;
+
+	if (length == 0 || text.size() < length)
+		return 0;
+
+	for (size_t i = 1; i < length; ++i)
+		if (((unsigned char)text[i] & 0xC0) != 0x80)
+			return 0;
+
+	// Overlong, surrogate and past U+10FFFF forms
+	unsigned char d = text[1];
+	if ((c == 0xE0 && d < 0xA0) || (c == 0xED && d >= 0xA0) || (c == 0xF0 && d < 0x90) || (c == 0xF4 && d >= 0x90))
+		return 0;
+
+	return length;
+}
+
+void appendJsonString(std::string &out, std::string_view text, bool latin1)
+{
+	out += '"';
+
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		unsigned char c = text[i];
+		size_t length = c >= 0x80 && !latin1 ? utf8Length(text.substr(i)) : 0;
+
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (length)
+		{
+			out += text.substr(i, length);
+			i += length - 1;
+		}
+		else if (c < 0x20 || c >= 0x80)
+		{
+			char escape[8];
+			snprintf(escape, sizeof escape, "\\u%04x", c);
+			out += escape;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+
+	out += '"';
+}
+
+void imageSidecar(const Image &image, uint32_t id, std::string &out)
+{
+	char line[192];
+
+	out.clear();
+	snprintf(line, sizeof line, "{\n\t\"id\": %u,\n\t\"name\": ", id);
+	out += line;
+	appendJsonString(out, image.name, true);
+
+	snprintf(line, sizeof line, ",\n\t\"width\": %zu,\n\t\"height\": %zu,\n\t\"xoff\": %zu,\n\t\"yoff\": %zu,\n\t\"mode\": %u\n}\n",
+		image.width, image.height, image.xoff, image.yoff, image.mode);
+	out += line;
+}
@@ -0,0 +1,67 @@
+/*
+	Output formats for ilb2png
+*/
+
+#ifndef IMGENC_H
+#define IMGENC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "arena.h"
+#include "decode.h"
+#include "pngenc.h"
+
+enum class OutputFormat
+{
+	Png,
+	// Bare r8g8b8a8 rows, size in the sidecar
+	Raw,
+	// Quite OK Image format, RGBA
+	Qoi,
+	// Uncompressed 32 bit Targa, top to bottom
+	Tga,
+	// Netpbm PAM, RGB_ALPHA
+	Pam
+};
+
+// Turns a decoded canvas into the bytes of one output file. Encoders keep no
+// state between images, so one is shared by every encode thread.
+class ImageEncoder
+{
+public:
+	virtual ~ImageEncoder() = default;
+
+	// File extension, without the dot
+	virtual const char *extension() const = 0;
+
+	// Whether the format loses the placement, name and mode of the image, so
+	// they have to go in a sidecar next to it
+	virtual bool needsSidecar() const { return true; }
+
+	// Encodes image, whose first layer is a record of the given type. The
+	// result lives in arena until it is next reset; nullptr if the image
+	// can't be encoded.
+	virtual const unsigned char *encode(const Image &image, uint32_t type, Arena &arena, size_t &size) const = 0;
+};
+
+// Parses png, raw, qoi, tga or pam
+bool parseOutputFormat(const char *name, OutputFormat &format);
+
+// The encoder for format. Only PNG looks at preset.
+std::unique_ptr<ImageEncoder> makeImageEncoder(OutputFormat format, PngPreset preset);
+
+// Appends text to out as a quoted JSON string. ILB names are legacy 8 bit
+// text, with latin1 every byte from 0x80 up is taken as Latin-1 and escaped.
+// Otherwise valid UTF-8 goes through as is and only stray bytes are escaped
+// that way, so the result is always valid UTF-8.
+void appendJsonString(std::string &out, std::string_view text, bool latin1 = false);
+
+// Replaces out with the JSON sidecar of image: id, name, size, offset and
+// mode. Keeps the capacity of out.
+void imageSidecar(const Image &image, uint32_t id, std::string &out);
+
+#endif
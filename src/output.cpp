@@ -0,0 +1,416 @@
+/*
+	Where ilb2png puts the files it makes
+*/
+
+#include "output.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+namespace
+{
+	// Plain table driven CRC-32 as zip wants it
+	struct CrcTable
+	{
+		uint32_t table[256];
+
+		CrcTable()
+		{
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k)
+					c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				table[i] = c;
+			}
+		}
+
+		uint32_t operator()(const unsigned char *data, size_t size) const
+		{
+			uint32_t crc = 0xFFFFFFFF;
+			for (size_t i = 0; i < size; ++i)
+				crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+			return ~crc;
+		}
+	};
+
+	const CrcTable crc32;
+
+	void put16LE(uint8_t *p, uint16_t v)
+	{
+		p[0] = v;
+		p[1] = v >> 8;
+	}
+
+	void put32LE(uint8_t *p, uint32_t v)
+	{
+		p[0] = v;
+		p[1] = v >> 8;
+		p[2] = v >> 16;
+		p[3] = v >> 24;
+	}
+
+	// Writes all of iov, going round again after short writes
+	bool writeAll(int fd, struct iovec *iov, int count)
+	{
+		while (count)
+		{
+			ssize_t n = writev(fd, iov, count);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+
+			while (count && (size_t)n >= iov->iov_len)
+			{
+				n -= iov->iov_len;
+				iov++;
+				count--;
+			}
+
+			if (count)
+			{
+				iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+				iov->iov_len -= n;
+			}
+		}
+
+		return true;
+	}
+}
+
+bool writeFile(const char *filename, const unsigned char *data, size_t size)
+{
+	return writeFileAt(AT_FDCWD, filename, data, size);
+}
+
+bool writeFileAt(int dirfd, const char *filename, const unsigned char *data, size_t size)
+{
+	int fd = ::openat(dirfd, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return false;
+
+	struct iovec iov = { const_cast<unsigned char*>(data), size };
+	bool ok = writeAll(fd, &iov, 1);
+
+	return ::close(fd) == 0 && ok;
+}
+
+bool DirectoryOutput::open(const std::filesystem::path &dir)
+{
+	if (!std::filesystem::is_directory(dir))
+	{
+		try
+		{
+			std::filesystem::create_directories(dir);
+		}
+		catch (std::filesystem::filesystem_error &e)
+		{
+			lastError = "Failed to create output directory " + dir.string() + ": " + e.what();
+			return false;
+		}
+	}
+
+	where = (dir / "").string();
+
+	dirfd = ::open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+	{
+		lastError = "Failed to open output directory " + dir.string() + ": " + strerror(errno);
+		return false;
+	}
+
+	return true;
+}
+
+DirectoryOutput::~DirectoryOutput()
+{
+	if (dirfd >= 0)
+		::close(dirfd);
+}
+
+bool DirectoryOutput::write(const char *name, const unsigned char *data, size_t size)
+{
+	return writeFileAt(dirfd, name, data, size);
+}
+
+int DirectoryOutput::resolve(const char *name, std::string &path)
+{
+	path = name;
+	return dirfd;
+}
+
+bool DirectoryOutput::makeDirectory(const std::string &name)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(where + name, ec);
+
+	if (ec)
+	{
+		lastError = "Failed to create output directory " + where + name + ": " + ec.message();
+		return false;
+	}
+
+	return true;
+}
+
+bool SubOutput::open(Output &parent, const std::string &prefix)
+{
+	this->parent = &parent;
+	this->prefix = prefix + "/";
+	where = parent.location() + this->prefix;
+
+	if (!parent.makeDirectory(prefix))
+	{
+		lastError = parent.error();
+		return false;
+	}
+
+	return true;
+}
+
+bool SubOutput::write(const char *name, const unsigned char *data, size_t size)
+{
+	static thread_local std::string path;
+
+	path = prefix;
+	path += name;
+
+	return parent->write(path.c_str(), data, size);
+}
+
+int SubOutput::resolve(const char *name, std::string &path)
+{
+	static thread_local std::string prefixed;
+
+	prefixed = prefix;
+	prefixed += name;
+
+	return parent->resolve(prefixed.c_str(), path);
+}
+
+bool SubOutput::makeDirectory(const std::string &name)
+{
+	return parent->makeDirectory(prefix + name);
+}
+
+ArchiveOutput::~ArchiveOutput()
+{
+	if (fd >= 0)
+		::close(fd);
+}
+
+bool ArchiveOutput::open(const std::filesystem::path &path)
+{
+	format = path.extension() == ".zip" ? ZIP : TAR;
+	time_t now = time(nullptr);
+	struct tm tm;
+	localtime_r(&now, &tm);
+
+	mtime = now;
+	dosTime = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+	dosDate = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+
+	// A copy of stdout, so the caller is free to point stdout elsewhere
+	if (path == "-")
+		fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	else
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+	if (fd < 0)
+	{
+		lastError = "Failed to create " + path.string() + ": " + strerror(errno);
+		return false;
+	}
+
+	where = path.string() + ":";
+	return true;
+}
+
+bool ArchiveOutput::append(const void *data, size_t size)
+{
+	struct iovec iov = { const_cast<void*>(data), size };
+
+	if (broken || !writeAll(fd, &iov, 1))
+	{
+		broken = true;
+		return false;
+	}
+
+	offset += size;
+	return true;
+}
+
+bool ArchiveOutput::write(const char *name, const unsigned char *data, size_t size)
+{
+	size_t nameLength = strlen(name);
+
+	if (format == TAR)
+	{
+		uint8_t header[512] = {};
+
+		// Long paths are split at a slash into the 155 byte prefix field and
+		// the 100 byte name field
+		size_t split = 0;
+		if (nameLength > 100)
+		{
+			const char *slash = strchr(name + nameLength - 101, '/');
+			if (!slash || slash - name > 155)
+				return false;
+			split = slash - name + 1;
+			memcpy(header + 345, name, split - 1);
+		}
+
+		memcpy(header, name + split, nameLength - split);
+		memcpy(header + 100, "0000644", 8);
+		memcpy(header + 108, "0000000", 8);
+		memcpy(header + 116, "0000000", 8);
+		snprintf(reinterpret_cast<char*>(header + 124), 12, "%011llo", (unsigned long long)size);
+		snprintf(reinterpret_cast<char*>(header + 136), 12, "%011o", mtime);
+		memset(header + 148, ' ', 8);
+		header[156] = '0';
+		memcpy(header + 257, "ustar", 6);
+		memcpy(header + 263, "00", 2);
+
+		unsigned sum = 0;
+		for (uint8_t c : header)
+			sum += c;
+		snprintf(reinterpret_cast<char*>(header + 148), 8, "%06o", sum);
+
+		static const uint8_t zeros[512] = {};
+		struct iovec iov[3] =
+		{
+			{ header, sizeof header },
+			{ const_cast<unsigned char*>(data), size },
+			{ const_cast<uint8_t*>(zeros), (512 - size % 512) % 512 }
+		};
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (broken || !writeAll(fd, iov, 3))
+		{
+			broken = true;
+			return false;
+		}
+
+		offset += sizeof header + size + (512 - size % 512) % 512;
+		return true;
+	}
+
+	uint32_t crc = crc32(data, size);
+
+	// Plain zip without the zip64 extensions tops out at 4G
+	if (nameLength > 0xFFFF || size > 0xFFFFFFFF)
+		return false;
+
+	uint8_t header[30];
+	put32LE(header, 0x04034B50);
+	put16LE(header + 4, 10); // version needed, 1.0 for stored
+	put16LE(header + 6, 0);  // flags
+	put16LE(header + 8, 0);  // stored
+	put16LE(header + 10, dosTime);
+	put16LE(header + 12, dosDate);
+	put32LE(header + 14, crc);
+	put32LE(header + 18, size);
+	put32LE(header + 22, size);
+	put16LE(header + 26, nameLength);
+	put16LE(header + 28, 0);
+
+	struct iovec iov[3] =
+	{
+		{ header, sizeof header },
+		{ const_cast<char*>(name), nameLength },
+		{ const_cast<unsigned char*>(data), size }
+	};
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (offset > 0xFFFFFFFF)
+		return false;
+
+	// Only an entry that is completely in the file goes in the directory
+	if (broken || !writeAll(fd, iov, 3))
+	{
+		broken = true;
+		return false;
+	}
+
+	entries.push_back({ name, crc, (uint32_t)size, (uint32_t)offset });
+	offset += sizeof header + nameLength + size;
+	return true;
+}
+
+bool ArchiveOutput::finish()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	bool ok;
+
+	if (broken)
+		ok = false;
+	else if (format == TAR)
+	{
+		// Two empty blocks end the archive
+		static const uint8_t zeros[1024] = {};
+		ok = append(zeros, sizeof zeros);
+	}
+	else
+	{
+		uint64_t directory = offset;
+		ok = directory <= 0xFFFFFFFF && entries.size() <= 0xFFFF;
+
+		for (size_t i = 0; ok && i < entries.size(); ++i)
+		{
+			const ZipEntry &entry = entries[i];
+			uint8_t header[46];
+
+			put32LE(header, 0x02014B50);
+			put16LE(header + 4, 3 << 8 | 10); // made by Unix, 1.0
+			put16LE(header + 6, 10);
+			put16LE(header + 8, 0);
+			put16LE(header + 10, 0);
+			put16LE(header + 12, dosTime);
+			put16LE(header + 14, dosDate);
+			put32LE(header + 16, entry.crc);
+			put32LE(header + 20, entry.size);
+			put32LE(header + 24, entry.size);
+			put16LE(header + 28, entry.name.size());
+			put16LE(header + 30, 0); // extra
+			put16LE(header + 32, 0); // comment
+			put16LE(header + 34, 0); // disk
+			put16LE(header + 36, 0); // internal attributes
+			put32LE(header + 38, 0100644u << 16);
+			put32LE(header + 42, entry.offset);
+
+			ok = append(header, sizeof header) && append(entry.name.data(), entry.name.size());
+		}
+
+		if (ok)
+		{
+			uint8_t end[22];
+
+			put32LE(end, 0x06054B50);
+			put16LE(end + 4, 0);
+			put16LE(end + 6, 0);
+			put16LE(end + 8, entries.size());
+			put16LE(end + 10, entries.size());
+			put32LE(end + 12, offset - directory);
+			put32LE(end + 16, directory);
+			put16LE(end + 20, 0);
+
+			ok = append(end, sizeof end) && offset <= 0xFFFFFFFF;
+		}
+	}
+
+	ok = ::close(fd) == 0 && ok;
+	fd = -1;
+
+	if (!ok)
+		lastError = "Failed to finish the archive " + where;
+
+	return ok;
+}
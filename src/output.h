@@ -0,0 +1,130 @@
+/*
+	Where ilb2png puts the files it makes
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Writes a whole file with plain syscalls, no stdio buffer to allocate
+bool writeFile(const char *filename, const unsigned char *data, size_t size);
+
+// Same, with filename relative to the directory dirfd
+bool writeFileAt(int dirfd, const char *filename, const unsigned char *data, size_t size);
+
+// A flat collection of named files. write may be called from any number of
+// threads at once.
+class Output
+{
+public:
+	virtual ~Output() = default;
+
+	// Writes one file called name
+	virtual bool write(const char *name, const unsigned char *data, size_t size) = 0;
+
+	// Makes sure files can be written under name/
+	virtual bool makeDirectory(const std::string &) { return true; }
+
+	// Finishes off the output after the last file; false if that failed
+	virtual bool finish() { return true; }
+
+	// For outputs that are plain files: the directory fd name goes in and
+	// sets path to name relative to it. -1 for anything else.
+	virtual int resolve(const char *, std::string &) { return -1; }
+
+	// Prefix for name in log messages
+	const std::string &location() const { return where; }
+
+	const std::string &error() const { return lastError; }
+
+protected:
+	std::string where;
+	std::string lastError;
+};
+
+// One file per name in a directory, which is created if it doesn't exist
+class DirectoryOutput : public Output
+{
+public:
+	~DirectoryOutput();
+
+	bool open(const std::filesystem::path &dir);
+
+	bool write(const char *name, const unsigned char *data, size_t size) override;
+	bool makeDirectory(const std::string &name) override;
+	int resolve(const char *name, std::string &path) override;
+
+private:
+	// Opened once, every file is created relative to it
+	int dirfd = -1;
+};
+
+// The files of one input of a batch, under prefix/ in another output
+class SubOutput : public Output
+{
+public:
+	bool open(Output &parent, const std::string &prefix);
+
+	bool write(const char *name, const unsigned char *data, size_t size) override;
+	bool makeDirectory(const std::string &name) override;
+	int resolve(const char *name, std::string &path) override;
+
+private:
+	Output *parent = nullptr;
+	std::string prefix;
+};
+
+// Every file appended to a single archive that is written strictly front to
+// back, so it can go to a pipe. Files are stored, never compressed.
+class ArchiveOutput : public Output
+{
+public:
+	enum Format
+	{
+		// POSIX ustar
+		TAR,
+		// Zip with stored entries
+		ZIP
+	};
+
+	~ArchiveOutput();
+
+	// "-" is stdout. Zip if path ends in .zip, tar otherwise.
+	bool open(const std::filesystem::path &path);
+
+	bool write(const char *name, const unsigned char *data, size_t size) override;
+	bool finish() override;
+
+private:
+	// What the zip central directory needs to know about an entry
+	struct ZipEntry
+	{
+		std::string name;
+		uint32_t crc;
+		uint32_t size;
+		uint32_t offset;
+	};
+
+	bool append(const void *data, size_t size);
+
+	std::mutex mutex;
+	int fd = -1;
+	Format format = TAR;
+	uint64_t offset = 0;
+	// Set once a write failed partway. Nothing after it would be where the
+	// offsets say, so every later write and finish fail.
+	bool broken = false;
+	// Every entry is stamped with the time the archive was opened
+	uint32_t mtime = 0;
+	uint16_t dosTime = 0;
+	uint16_t dosDate = 0;
+	std::vector<ZipEntry> entries;
+};
+
+#endif
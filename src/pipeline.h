@@ -0,0 +1,333 @@
+/*
+	Bounded queues and per stage bookkeeping for the ilb2png pipeline
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "imgenc.h"
+
+// What --stats reports at exit
+enum class StatsFormat
+{
+	None,
+	Text,
+	Json
+};
+
+// Queue depth between two stages and threads per stage
+struct PipelineConfig
+{
+	size_t queueDepth = 4;
+	unsigned decodeThreads = 1;
+	unsigned encodeThreads = 1;
+	unsigned writeThreads = 1;
+
+	// Blend later layers of a composite into the base canvas as they are
+	// decoded instead of giving each its own canvas first
+	bool fuseLayers = true;
+
+	OutputFormat format = OutputFormat::Png;
+
+	// Page size of the atlas, 0 for one file per image
+	size_t atlasSize = 0;
+	PngPreset png = PngPreset::Default;
+
+	StatsFormat stats = StatsFormat::None;
+	// File the JSON stats go to, empty for stderr so they don't mix with
+	// the log on stdout
+	std::string statsFile;
+
+	// Chrome trace file to write at exit, empty for none
+	std::string trace;
+
+	// Bytes the images in flight may hold at once, 0 for no limit
+	uint64_t maxMemory = 0;
+
+	// Write plain files through io_uring where the kernel has it
+	bool ioUring = true;
+
+	// Read the pixel data of the selected images in file order ahead of
+	// the decoders
+	bool readahead = true;
+};
+
+// What a stage did and how long it sat waiting on its neighbours. A stage
+// that waits on input is starved by the stage before it, a stage that waits
+// on output is stalled by the stage after it.
+struct StageStats
+{
+	const char *name;
+	unsigned threads = 1;
+
+	std::atomic<uint64_t> items { 0 };
+	std::atomic<uint64_t> busyNs { 0 };
+
+	std::atomic<uint64_t> inputWaits { 0 };
+	std::atomic<uint64_t> inputWaitNs { 0 };
+	std::atomic<uint64_t> outputWaits { 0 };
+	std::atomic<uint64_t> outputWaitNs { 0 };
+
+	explicit StageStats(const char *name) : name(name) {}
+};
+
+inline uint64_t pipelineNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Multi producer, multi consumer FIFO of fixed capacity, kept in a ring so
+// moving items through it never allocates. It closes itself once every
+// producer has called producerDone, after which pop drains what is left and
+// then returns false.
+template <typename T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(size_t capacity, unsigned producers) : items(capacity ? capacity : 1), producers(producers) {}
+
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	void push(T &&item, StageStats &stats)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (count == items.size())
+		{
+			uint64_t start = pipelineNow();
+			notFull.wait(lock, [this] { return count < items.size(); });
+			stats.outputWaits++;
+			stats.outputWaitNs += pipelineNow() - start;
+		}
+
+		items[(head + count++) % items.size()] = std::move(item);
+		lock.unlock();
+		notEmpty.notify_one();
+	}
+
+	bool pop(T &item, StageStats &stats)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!count && producers)
+		{
+			uint64_t start = pipelineNow();
+			notEmpty.wait(lock, [this] { return count || !producers; });
+			stats.inputWaits++;
+			stats.inputWaitNs += pipelineNow() - start;
+		}
+
+		if (!count)
+			return false;
+
+		item = std::move(items[head]);
+		head = (head + 1) % items.size();
+		count--;
+		lock.unlock();
+		notFull.notify_one();
+
+		return true;
+	}
+
+	// Like pop, but returns false at once instead of waiting when the queue
+	// is empty
+	bool tryPop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!count)
+			return false;
+
+		item = std::move(items[head]);
+		head = (head + 1) % items.size();
+		count--;
+		lock.unlock();
+		notFull.notify_one();
+
+		return true;
+	}
+
+	void producerDone()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (producers && --producers == 0)
+			notEmpty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+	std::vector<T> items;
+	size_t head = 0;
+	size_t count = 0;
+	unsigned producers;
+};
+
+// Items handed back once they are done with, so a steady stream of work
+// keeps recycling the same handful instead of allocating new ones
+template <typename T>
+class FreeList
+{
+public:
+	bool take(T &item)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (items.empty())
+			return false;
+
+		item = std::move(items.back());
+		items.pop_back();
+		return true;
+	}
+
+	void give(T &&item)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		items.push_back(std::move(item));
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<T> items;
+};
+
+// Byte budget shared by everything the pipeline holds on to. acquire never
+// blocks, wait does until something is released or handed back, so the
+// caller can decide between reusing what it has and waiting for more.
+class MemoryBudget
+{
+public:
+	explicit MemoryBudget(uint64_t limit) : limit(limit) {}
+
+	// Takes bytes if they fit, or if nothing but the reserve is taken, so a
+	// single image bigger than the whole budget still gets through on its own
+	bool acquire(uint64_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (limit && used > reserved && used + bytes > limit)
+			return false;
+
+		used += bytes;
+		peak = std::max(peak, used);
+		return true;
+	}
+
+	// Takes bytes for the whole run, whether they fit or not
+	void reserve(uint64_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		reserved += bytes;
+		used += bytes;
+		peak = std::max(peak, used);
+	}
+
+	void release(uint64_t bytes)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			used -= bytes;
+			generation++;
+		}
+
+		changed.notify_all();
+	}
+
+	// Something that may let a waiting acquire through came back
+	void notify()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			generation++;
+		}
+
+		changed.notify_all();
+	}
+
+	// Read before trying, then pass to wait, so a release in between isn't
+	// missed
+	uint64_t state()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return generation;
+	}
+
+	void wait(uint64_t seen, StageStats &stats)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t start = pipelineNow();
+
+		changed.wait(lock, [&] { return generation != seen; });
+		stats.outputWaits++;
+		stats.outputWaitNs += pipelineNow() - start;
+	}
+
+	uint64_t highWater()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return peak;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	uint64_t limit;
+	uint64_t used = 0;
+	uint64_t reserved = 0;
+	uint64_t peak = 0;
+	uint64_t generation = 0;
+};
+
+// Per image log. Unlike an ostringstream, clear keeps the buffer.
+class JobLog : public std::ostream
+{
+public:
+	JobLog() : std::ostream(&buffer)
+	{
+		// Enough for the messages of a sizable composite
+		buffer.text.reserve(1024);
+	}
+
+	const std::string &text() const { return buffer.text; }
+	void reset() { buffer.text.clear(); }
+
+private:
+	struct Buffer : std::streambuf
+	{
+		std::string text;
+
+		int_type overflow(int_type c) override
+		{
+			if (c != traits_type::eof())
+				text.push_back(traits_type::to_char_type(c));
+			return c;
+		}
+
+		std::streamsize xsputn(const char *s, std::streamsize n) override
+		{
+			text.append(s, n);
+			return n;
+		}
+	};
+
+	Buffer buffer;
+};
+
+#endif
@@ -0,0 +1,365 @@
+/*
+	Pixel conversion kernels shared by the ILB decoders
+*/
+
+#include "pixel.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define PIXEL_X86 1
+#endif
+
+// The channel expansions below are the exact integer forms of
+// (x * 255) / 31, (x * 255) / 63, sum / 3 and (a * 175) / 100, chosen so
+// every intermediate fits a 16 bit lane.
+static inline uint8_t expand5(uint32_t x) { return (x * 1053) >> 7; }
+static inline uint8_t expand6(uint32_t x) { return (x * 259 + 3) >> 6; }
+
+template <PixelAlpha Mode>
+static void convertScalar(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, uint8_t alpha)
+{
+	for (size_t i = 0; i < count; ++i, dst += 4)
+	{
+		uint32_t pixel = src[i];
+
+		if (pixel == transparent)
+		{
+			dst[0] = dst[1] = dst[2] = dst[3] = 0;
+			continue;
+		}
+
+		uint8_t r = expand5((pixel >> 11) & 0x1F);
+		uint8_t g = expand6((pixel >>  5) & 0x3F);
+		uint8_t b = expand5((pixel >>  0) & 0x1F);
+
+		dst[0] = r;
+		dst[1] = g;
+		dst[2] = b;
+		dst[3] = pixelAlpha<Mode>(r, g, b, alpha);
+	}
+}
+
+// For a straight alpha source s over destination d with alphas A and D
+// (0-255), source-over works out to
+//     N     = A * 255 + D * (255 - A)
+//     out_a = N / 255
+//     out_c = (s_c * A * 255 + d_c * D * (255 - A)) / N
+// with every product below 2^24. Over an opaque destination N is 255 * 255
+// and out_c becomes (s_c * A + d_c * (255 - A)) / 255.
+static void compositeScalar(const uint8_t *src, uint8_t *dst, size_t count)
+{
+	for (size_t i = 0; i < count; ++i, src += 4, dst += 4)
+	{
+		uint32_t sa = src[3];
+
+		if (sa == 0)
+			continue;
+
+		if (sa == 255)
+		{
+			memcpy(dst, src, 4);
+			continue;
+		}
+
+		uint32_t inva = 255 - sa;
+		uint32_t w = dst[3] * inva;
+		uint32_t n = sa * 255 + w;
+
+		dst[0] = (src[0] * sa * 255 + dst[0] * w) / n;
+		dst[1] = (src[1] * sa * 255 + dst[1] * w) / n;
+		dst[2] = (src[2] * sa * 255 + dst[2] * w) / n;
+		dst[3] = n / 255;
+	}
+}
+
+#ifdef PIXEL_X86
+
+// 8 pixels in, 8 pixels out as two 16 byte stores
+template <PixelAlpha Mode>
+static inline void convert8SSE2(const Pixel565 *src, uint8_t *dst, bool keyed, __m128i key, __m128i alpha)
+{
+	const __m128i mask5 = _mm_set1_epi16(0x1F);
+	const __m128i mask6 = _mm_set1_epi16(0x3F);
+
+	__m128i p = _mm_loadu_si128((const __m128i*)src);
+
+	__m128i r = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(p, 11), mask5), _mm_set1_epi16(1053)), 7);
+	__m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(p, 5), mask6), _mm_set1_epi16(259)), _mm_set1_epi16(3)), 6);
+	__m128i b = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(p, mask5), _mm_set1_epi16(1053)), 7);
+	__m128i a = alpha;
+
+	if (Mode != ALPHA_CONSTANT)
+	{
+		__m128i third = _mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(r, g), b), _mm_set1_epi16(21846));
+
+		if (Mode == ALPHA_ADDITIVE)
+			a = third;
+		else if (Mode == ALPHA_BRIGHT)
+			a = _mm_min_epi16(_mm_srli_epi16(_mm_mullo_epi16(third, _mm_set1_epi16(7)), 2), _mm_set1_epi16(255));
+		else
+			a = _mm_sub_epi16(_mm_set1_epi16(255), third);
+	}
+
+	__m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+	__m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+
+	__m128i lo = _mm_unpacklo_epi16(rg, ba);
+	__m128i hi = _mm_unpackhi_epi16(rg, ba);
+
+	if (keyed)
+	{
+		__m128i clear = _mm_cmpeq_epi16(p, key);
+		lo = _mm_andnot_si128(_mm_unpacklo_epi16(clear, clear), lo);
+		hi = _mm_andnot_si128(_mm_unpackhi_epi16(clear, clear), hi);
+	}
+
+	_mm_storeu_si128((__m128i*)dst, lo);
+	_mm_storeu_si128((__m128i*)(dst + 16), hi);
+}
+
+template <PixelAlpha Mode>
+static void convertSSE2(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, uint8_t alpha)
+{
+	const bool keyed = transparent <= 0xFFFF;
+	const __m128i key = _mm_set1_epi16((short)transparent);
+	const __m128i alphav = _mm_set1_epi16(alpha);
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+		convert8SSE2<Mode>(src + i, dst + 4 * i, keyed, key, alphav);
+
+	convertScalar<Mode>(src + i, count - i, dst + 4 * i, transparent, alpha);
+}
+
+// 16 pixels in, 16 pixels out as two 32 byte stores
+template <PixelAlpha Mode>
+__attribute__((target("avx2")))
+static void convertAVX2(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, uint8_t alpha)
+{
+	const __m256i mask5 = _mm256_set1_epi16(0x1F);
+	const __m256i mask6 = _mm256_set1_epi16(0x3F);
+	const __m256i alphav = _mm256_set1_epi16(alpha);
+	const bool keyed = transparent <= 0xFFFF;
+	const __m256i key = _mm256_set1_epi16((short)transparent);
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+
+		__m256i r = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(p, 11), mask5), _mm256_set1_epi16(1053)), 7);
+		__m256i g = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(p, 5), mask6), _mm256_set1_epi16(259)), _mm256_set1_epi16(3)), 6);
+		__m256i b = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(p, mask5), _mm256_set1_epi16(1053)), 7);
+		__m256i a = alphav;
+
+		if (Mode != ALPHA_CONSTANT)
+		{
+			__m256i third = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(r, g), b), _mm256_set1_epi16(21846));
+
+			if (Mode == ALPHA_ADDITIVE)
+				a = third;
+			else if (Mode == ALPHA_BRIGHT)
+				a = _mm256_min_epi16(_mm256_srli_epi16(_mm256_mullo_epi16(third, _mm256_set1_epi16(7)), 2), _mm256_set1_epi16(255));
+			else
+				a = _mm256_sub_epi16(_mm256_set1_epi16(255), third);
+		}
+
+		__m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+		__m256i ba = _mm256_or_si256(b, _mm256_slli_epi16(a, 8));
+
+		// unpack works per 128 bit lane, so this is pixels 0-3 | 8-11 and 4-7 | 12-15
+		__m256i lo = _mm256_unpacklo_epi16(rg, ba);
+		__m256i hi = _mm256_unpackhi_epi16(rg, ba);
+
+		if (keyed)
+		{
+			__m256i clear = _mm256_cmpeq_epi16(p, key);
+			lo = _mm256_andnot_si256(_mm256_unpacklo_epi16(clear, clear), lo);
+			hi = _mm256_andnot_si256(_mm256_unpackhi_epi16(clear, clear), hi);
+		}
+
+		_mm256_storeu_si256((__m256i*)(dst + 4 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dst + 4 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	convertSSE2<Mode>(src + i, count - i, dst + 4 * i, transparent, alpha);
+}
+
+__attribute__((target("avx2")))
+static void convertPal8AVX2(const uint8_t *src, size_t count, uint8_t *dst, const uint32_t *lut)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+		__m256i pixels = _mm256_i32gather_epi32((const int*)lut, index, 4);
+		_mm256_storeu_si256((__m256i*)(dst + 4 * i), pixels);
+	}
+
+	for (; i < count; ++i)
+		memcpy(dst + 4 * i, &lut[src[i]], 4);
+}
+
+// Opaque destination, 4 pixels: (s_c * A + d_c * (255 - A)) / 255 in 16 bit
+// lanes. x / 255 == (x + 1 + (x >> 8)) >> 8 for every x up to 255 * 255.
+static inline __m128i compositeOpaqueSSE2(__m128i s, __m128i d)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i one = _mm_set1_epi16(1);
+
+	__m128i slo = _mm_unpacklo_epi8(s, zero);
+	__m128i shi = _mm_unpackhi_epi8(s, zero);
+	__m128i dlo = _mm_unpacklo_epi8(d, zero);
+	__m128i dhi = _mm_unpackhi_epi8(d, zero);
+
+	__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+	__m128i xlo = _mm_add_epi16(_mm_mullo_epi16(slo, alo), _mm_mullo_epi16(dlo, _mm_sub_epi16(full, alo)));
+	__m128i xhi = _mm_add_epi16(_mm_mullo_epi16(shi, ahi), _mm_mullo_epi16(dhi, _mm_sub_epi16(full, ahi)));
+
+	xlo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(xlo, one), _mm_srli_epi16(xlo, 8)), 8);
+	xhi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(xhi, one), _mm_srli_epi16(xhi, 8)), 8);
+
+	return _mm_or_si128(_mm_packus_epi16(xlo, xhi), _mm_set1_epi32(0xFF000000));
+}
+
+// Any destination, 4 pixels with one channel per register. The numerators
+// and N are exact integers below 2^24, so they are exact as floats, and a
+// correctly rounded quotient of two such numbers never crosses an integer.
+// Truncating it gives the same result as integer division.
+static inline __m128i compositeBlendSSE2(__m128i s, __m128i d)
+{
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	const __m128 full = _mm_set1_ps(255.0f);
+
+	__m128 sa = _mm_cvtepi32_ps(_mm_srli_epi32(s, 24));
+	__m128 da = _mm_cvtepi32_ps(_mm_srli_epi32(d, 24));
+
+	__m128 sw = _mm_mul_ps(sa, full);
+	__m128 dw = _mm_mul_ps(da, _mm_sub_ps(full, sa));
+	__m128 n = _mm_add_ps(sw, dw);
+
+	// N is only 0 for lanes that get thrown away below
+	n = _mm_max_ps(n, _mm_set1_ps(1.0f));
+
+	__m128i out = _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(n, full)), 24);
+
+	for (int shift = 0; shift < 24; shift += 8)
+	{
+		__m128 sc = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(s, shift), mask));
+		__m128 dc = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(d, shift), mask));
+		__m128 num = _mm_add_ps(_mm_mul_ps(sc, sw), _mm_mul_ps(dc, dw));
+
+		out = _mm_or_si128(out, _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(num, n)), shift));
+	}
+
+	return out;
+}
+
+static void compositeSSE2(const uint8_t *src, uint8_t *dst, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+		__m128i sa = _mm_and_si128(s, opaque);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xFFFF)
+			continue;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, opaque)) == 0xFFFF)
+		{
+			_mm_storeu_si128((__m128i*)(dst + 4 * i), s);
+			continue;
+		}
+
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + 4 * i));
+		__m128i out;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(d, opaque), opaque)) == 0xFFFF)
+			out = compositeOpaqueSSE2(s, d);
+		else
+			out = compositeBlendSSE2(s, d);
+
+		// Transparent over transparent keeps whatever colour d had
+		__m128i keep = _mm_cmpeq_epi32(sa, zero);
+		out = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, out));
+
+		_mm_storeu_si128((__m128i*)(dst + 4 * i), out);
+	}
+
+	compositeScalar(src + 4 * i, dst + 4 * i, count - i);
+}
+
+#endif
+
+void compositeOver(const uint8_t *src, uint8_t *dst, size_t count)
+{
+#ifdef PIXEL_X86
+	compositeSSE2(src, dst, count);
+#else
+	compositeScalar(src, dst, count);
+#endif
+}
+
+void convertPal8(const uint8_t *src, size_t count, uint8_t *dst, const uint32_t *lut)
+{
+#ifdef PIXEL_X86
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+
+	if (hasAVX2)
+	{
+		convertPal8AVX2(src, count, dst, lut);
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < count; ++i)
+		memcpy(dst + 4 * i, &lut[src[i]], 4);
+}
+
+template <PixelAlpha Mode>
+void convert565(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, uint8_t alpha)
+{
+#ifdef PIXEL_X86
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+
+	if (hasAVX2)
+		convertAVX2<Mode>(src, count, dst, transparent, alpha);
+	else
+		convertSSE2<Mode>(src, count, dst, transparent, alpha);
+#else
+	convertScalar<Mode>(src, count, dst, transparent, alpha);
+#endif
+}
+
+void convert565(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, PixelAlpha mode, uint8_t alpha)
+{
+	switch (mode)
+	{
+	case ALPHA_ADDITIVE:
+		convert565<ALPHA_ADDITIVE>(src, count, dst, transparent, alpha);
+		break;
+	case ALPHA_BRIGHT:
+		convert565<ALPHA_BRIGHT>(src, count, dst, transparent, alpha);
+		break;
+	case ALPHA_MULTIPLY:
+		convert565<ALPHA_MULTIPLY>(src, count, dst, transparent, alpha);
+		break;
+	default:
+		convert565<ALPHA_CONSTANT>(src, count, dst, transparent, alpha);
+	}
+}
+
+template void convert565<ALPHA_CONSTANT>(const Pixel565 *, size_t, uint8_t *, uint32_t, uint8_t);
+template void convert565<ALPHA_ADDITIVE>(const Pixel565 *, size_t, uint8_t *, uint32_t, uint8_t);
+template void convert565<ALPHA_BRIGHT>(const Pixel565 *, size_t, uint8_t *, uint32_t, uint8_t);
+template void convert565<ALPHA_MULTIPLY>(const Pixel565 *, size_t, uint8_t *, uint32_t, uint8_t);
@@ -0,0 +1,93 @@
+/*
+	Pixel conversion kernels shared by the ILB decoders
+*/
+
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+// r5g6b5 pixels straight out of the file mapping. v3 libraries store the
+// pixel data inline behind a record of arbitrary length, so it is only byte
+// aligned.
+typedef uint16_t Pixel565 __attribute__((aligned(1), may_alias));
+
+// How the alpha channel of a converted pixel is produced
+enum PixelAlpha
+{
+	// Same alpha for every pixel
+	ALPHA_CONSTANT,
+	// Additive, just treat the general brightness as the alpha because lazy
+	ALPHA_ADDITIVE,
+	// Super bright! Additive times 1.75, clamped
+	ALPHA_BRIGHT,
+	// Multiply, just do the inverse of additive
+	ALPHA_MULTIPLY
+};
+
+// Picks the alpha kernel for an ILB show mode and blend mode
+inline PixelAlpha pixelAlphaMode(int show, int blend)
+{
+	if (show != 2)
+		return ALPHA_CONSTANT;
+
+	switch (blend)
+	{
+	case 2:
+		return ALPHA_ADDITIVE;
+	case 3:
+		return ALPHA_BRIGHT;
+	case 4:
+		return ALPHA_MULTIPLY;
+	default:
+		return ALPHA_CONSTANT;
+	}
+}
+
+// Alpha of one converted pixel
+template <PixelAlpha Mode>
+inline uint8_t pixelAlpha(uint8_t r, uint8_t g, uint8_t b, uint8_t alpha)
+{
+	uint32_t sum = r + g + b;
+
+	switch (Mode)
+	{
+	case ALPHA_ADDITIVE:
+		return sum / 3;
+	case ALPHA_BRIGHT:
+		{
+			uint32_t brighta = ((sum / 3) * 175) / 100;
+			return brighta > 255 ? 255 : brighta;
+		}
+	case ALPHA_MULTIPLY:
+		return 255 - (sum / 3);
+	default:
+		return alpha;
+	}
+}
+
+// Expands count r5g6b5 pixels into r8g8b8a8 at dst. Pixels equal to
+// transparent come out as 0,0,0,0; keys above 0xFFFF never match. alpha is
+// only used for ALPHA_CONSTANT. Uses AVX2 or SSE2 where the CPU has them and
+// is bit exact with the scalar (x * 255) / 31 style expansion.
+void convert565(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, PixelAlpha mode, uint8_t alpha);
+
+// Same with the alpha mode picked at compile time, for decoders that already
+// dispatched on it once per image
+template <PixelAlpha Mode>
+void convert565(const Pixel565 *src, size_t count, uint8_t *dst, uint32_t transparent, uint8_t alpha);
+
+// Looks count palette indices up in lut, a table of finished RGBA pixels as
+// laid out in memory, and writes them to dst. Gathers 8 pixels at a time
+// where the CPU has AVX2.
+void convertPal8(const uint8_t *src, size_t count, uint8_t *dst, const uint32_t *lut);
+
+// Source-over of count straight alpha RGBA pixels from src onto dst. Works
+// in exact integer arithmetic and rounds down, so it is never more than 1
+// off per channel from the old float implementation (which is itself that
+// far off the true result). Lanes with source alpha 0 leave dst alone, alpha
+// 255 copies src.
+void compositeOver(const uint8_t *src, uint8_t *dst, size_t count);
+
+#endif
@@ -0,0 +1,815 @@
+/*
+	PNG encoding for ilb2png
+*/
+
+#include "pngenc.h"
+
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// stb allocates and frees a lot per image, so it works out of the arena of
+// whoever is encoding
+static thread_local Arena *stbArena;
+
+#define STBIW_MALLOC(sz)                   stbArena->alloc(sz)
+#define STBIW_REALLOC_SIZED(p,oldsz,newsz) stbArena->realloc(p, oldsz, newsz)
+#define STBIW_FREE(p)                      ((void)(p))
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+namespace
+{
+	uint32_t reverseBits(uint32_t code, unsigned length)
+	{
+		uint32_t res = 0;
+
+		while (length--)
+		{
+			res = (res << 1) | (code & 1);
+			code >>= 1;
+		}
+
+		return res;
+	}
+
+	// The fixed Huffman codes of deflate, bit reversed ready for output,
+	// and the PNG CRC table
+	struct Tables
+	{
+		uint16_t lit[288];
+		uint8_t litLength[288];
+		uint16_t dist[30];
+		uint32_t crc[256];
+
+		Tables()
+		{
+			for (uint32_t i = 0; i < 288; ++i)
+			{
+				if (i <= 143)
+					litLength[i] = 8, lit[i] = reverseBits(0x30 + i, 8);
+				else if (i <= 255)
+					litLength[i] = 9, lit[i] = reverseBits(0x190 + i - 144, 9);
+				else if (i <= 279)
+					litLength[i] = 7, lit[i] = reverseBits(i - 256, 7);
+				else
+					litLength[i] = 8, lit[i] = reverseBits(0xC0 + i - 280, 8);
+			}
+
+			for (uint32_t i = 0; i < 30; ++i)
+				dist[i] = reverseBits(i, 5);
+
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k)
+					c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				crc[i] = c;
+			}
+		}
+	};
+
+	const Tables tables;
+
+	uint32_t load32(const uint8_t *p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	void put32BE(uint8_t *p, uint32_t v)
+	{
+		p[0] = v >> 24;
+		p[1] = v >> 16;
+		p[2] = v >> 8;
+		p[3] = v;
+	}
+
+	uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+	{
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = tables.crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	uint32_t adler32(const uint8_t *data, size_t size)
+	{
+		uint32_t s1 = 1;
+		uint32_t s2 = 0;
+
+		while (size)
+		{
+			size_t block = std::min<size_t>(size, 5552);
+
+			for (size_t i = 0; i < block; ++i)
+			{
+				s1 += data[i];
+				s2 += s1;
+			}
+
+			s1 %= 65521;
+			s2 %= 65521;
+			data += block;
+			size -= block;
+		}
+
+		return (s2 << 16) | s1;
+	}
+
+	uint8_t paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+
+		if (pa <= pb && pa <= pc)
+			return a;
+		if (pb <= pc)
+			return b;
+		return c;
+	}
+
+	// One RGBA row, prev is the unfiltered row above (zeros for the first)
+	void filterRow(PngFilter filter, const uint8_t *row, const uint8_t *prev, size_t length, uint8_t *out)
+	{
+		size_t i = 0;
+
+		switch (filter)
+		{
+		case PNG_FILTER_SUB:
+			for (; i < 4; ++i)
+				out[i] = row[i];
+			for (; i < length; ++i)
+				out[i] = row[i] - row[i - 4];
+			break;
+		case PNG_FILTER_UP:
+			for (; i < length; ++i)
+				out[i] = row[i] - prev[i];
+			break;
+		case PNG_FILTER_AVG:
+			for (; i < 4; ++i)
+				out[i] = row[i] - (prev[i] >> 1);
+			for (; i < length; ++i)
+				out[i] = row[i] - ((row[i - 4] + prev[i]) >> 1);
+			break;
+		case PNG_FILTER_PAETH:
+			for (; i < 4; ++i)
+				out[i] = row[i] - prev[i];
+			for (; i < length; ++i)
+				out[i] = row[i] - paeth(row[i - 4], prev[i], prev[i - 4]);
+			break;
+		default:
+			memcpy(out, row, length);
+		}
+	}
+
+	// LSB first bit output for deflate
+	struct BitWriter
+	{
+		uint8_t *out;
+		uint64_t bits = 0;
+		unsigned count = 0;
+
+		explicit BitWriter(uint8_t *out) : out(out) {}
+
+		void put(uint32_t value, unsigned length)
+		{
+			bits |= (uint64_t)value << count;
+			count += length;
+
+			if (count >= 32)
+			{
+				out[0] = bits;
+				out[1] = bits >> 8;
+				out[2] = bits >> 16;
+				out[3] = bits >> 24;
+				out += 4;
+				bits >>= 32;
+				count -= 32;
+			}
+		}
+
+		// Pads to a byte boundary and writes out what is left
+		uint8_t *finish()
+		{
+			while (count > 0)
+			{
+				*out++ = bits;
+				bits >>= 8;
+				count = count > 8 ? count - 8 : 0;
+			}
+
+			return out;
+		}
+
+		void literal(uint8_t c)
+		{
+			put(tables.lit[c], tables.litLength[c]);
+		}
+
+		void match(size_t length, size_t distance)
+		{
+			uint32_t x = length - 3;
+
+			if (length == 258)
+				put(tables.lit[285], tables.litLength[285]);
+			else if (x < 8)
+				put(tables.lit[257 + x], tables.litLength[257 + x]);
+			else
+			{
+				unsigned top = 31 - __builtin_clz(x);
+				unsigned extra = top - 2;
+				unsigned sym = 257 + 4 * (top - 1) + ((x >> extra) & 3);
+
+				put(tables.lit[sym], tables.litLength[sym]);
+				put(x & ((1u << extra) - 1), extra);
+			}
+
+			uint32_t y = distance - 1;
+
+			if (y < 4)
+				put(tables.dist[y], 5);
+			else
+			{
+				unsigned top = 31 - __builtin_clz(y);
+				unsigned extra = top - 1;
+
+				put(tables.dist[2 * top + ((y >> extra) & 1)], 5);
+				put(y & ((1u << extra) - 1), extra);
+			}
+		}
+	};
+
+	// Stored deflate blocks, at most size + 5 per 64K + 5 bytes
+	uint8_t *deflateStore(const uint8_t *data, size_t size, uint8_t *out)
+	{
+		do
+		{
+			size_t block = std::min<size_t>(size, 65535);
+
+			*out++ = block == size;
+			*out++ = block;
+			*out++ = block >> 8;
+			*out++ = ~block;
+			*out++ = ~block >> 8;
+
+			memcpy(out, data, block);
+			out += block;
+			data += block;
+			size -= block;
+		} while (size);
+
+		return out;
+	}
+
+	// Hash heads and chain links of the calling thread's deflate. Allocated
+	// once per thread.
+	struct DeflateScratch
+	{
+		static const unsigned HashBits = 15;
+		static const size_t WindowMask = 32767;
+
+		std::vector<uint32_t> head;
+		std::vector<uint32_t> prev;
+
+		DeflateScratch() : head(1 << HashBits), prev(WindowMask + 1) {}
+
+		static uint32_t hash(uint32_t v)
+		{
+			return (v * 2654435761u) >> (32 - HashBits);
+		}
+
+		// Positions are stored + 1 so 0 means empty
+		uint32_t insert(uint32_t v, size_t pos)
+		{
+			uint32_t &slot = head[hash(v)];
+			uint32_t candidate = slot;
+
+			prev[pos & WindowMask] = candidate;
+			slot = pos + 1;
+
+			return candidate;
+		}
+	};
+
+	thread_local DeflateScratch scratch;
+
+	size_t matchLength(const uint8_t *a, const uint8_t *b, size_t limit)
+	{
+		size_t length = 4;
+
+		while (length + 8 <= limit)
+		{
+			uint64_t x, y;
+			memcpy(&x, a + length, 8);
+			memcpy(&y, b + length, 8);
+
+			if (x != y)
+				return length + (__builtin_ctzll(x ^ y) >> 3);
+
+			length += 8;
+		}
+
+		while (length < limit && a[length] == b[length])
+			length++;
+
+		return length;
+	}
+
+	// Deflates data[begin, end) as one fixed Huffman block. Matches may reach
+	// back into the 32K before begin, which is hashed first, so a chunk
+	// compresses as if the stream had never been cut. Greedy LZ77 over hash
+	// chains of at most maxChain candidates; with 1 that is a single probe,
+	// which is plenty for the long transparent and flat runs in sprites.
+	// Anything but the last chunk ends on a sync flush so chunks can simply
+	// be concatenated. At most 9 bits per input byte plus 16 bytes.
+	uint8_t *deflateChunk(const uint8_t *data, size_t begin, size_t end, unsigned maxChain, bool last, uint8_t *out)
+	{
+		std::fill(scratch.head.begin(), scratch.head.end(), 0);
+
+		for (size_t pos = begin > 32768 ? begin - 32768 : 0; pos < begin; ++pos)
+			scratch.insert(load32(data + pos), pos);
+
+		BitWriter bw(out);
+		bw.put(last, 1); // BFINAL
+		bw.put(1, 2);    // BTYPE = fixed Huffman
+
+		size_t i = begin;
+
+		while (i + 4 <= end)
+		{
+			uint32_t v = load32(data + i);
+			uint32_t candidate = scratch.insert(v, i);
+			size_t limit = std::min<size_t>(258, end - i);
+			size_t best = 0;
+			size_t distance = 0;
+
+			for (unsigned n = 0; candidate && n < maxChain; ++n)
+			{
+				size_t c = candidate - 1;
+				if (c >= i || i - c > 32768)
+					break;
+
+				if (load32(data + c) == v)
+				{
+					size_t length = matchLength(data + c, data + i, limit);
+					if (length > best)
+					{
+						best = length;
+						distance = i - c;
+						if (length == limit)
+							break;
+					}
+				}
+
+				candidate = scratch.prev[c & DeflateScratch::WindowMask];
+			}
+
+			if (!best)
+			{
+				bw.literal(data[i]);
+				i++;
+				continue;
+			}
+
+			bw.match(best, distance);
+
+			// Deeper searches want the positions inside the match too
+			if (maxChain > 1)
+				for (size_t pos = i + 1; pos < i + best && pos + 4 <= end; ++pos)
+					scratch.insert(load32(data + pos), pos);
+
+			i += best;
+		}
+
+		for (; i < end; ++i)
+			bw.literal(data[i]);
+
+		bw.put(0, 7); // end of block
+
+		if (last)
+			return bw.finish();
+
+		// Sync flush: an empty stored block
+		bw.put(0, 3);
+		out = bw.finish();
+		*out++ = 0x00;
+		*out++ = 0x00;
+		*out++ = 0xFF;
+		*out++ = 0xFF;
+
+		return out;
+	}
+
+	size_t deflateBound(size_t size)
+	{
+		return size + size / 8 + 16;
+	}
+
+	// Adler-32 of two pieces back to back, from the Adler-32 of each
+	uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2)
+	{
+		const uint32_t base = 65521;
+		uint32_t rem = length2 % base;
+		uint32_t sum1 = adler1 & 0xFFFF;
+		uint32_t sum2 = (uint64_t)rem * sum1 % base;
+
+		sum1 += (adler2 & 0xFFFF) + base - 1;
+		sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+
+		if (sum1 >= base)
+			sum1 -= base;
+		if (sum1 >= base)
+			sum1 -= base;
+		if (sum2 >= 2 * base)
+			sum2 -= 2 * base;
+		if (sum2 >= base)
+			sum2 -= base;
+
+		return sum1 | (sum2 << 16);
+	}
+
+	// a * b modulo the CRC polynomial, in the reflected bit order of the CRC
+	uint32_t crcMultiply(uint32_t a, uint32_t b)
+	{
+		uint32_t m = 1u << 31;
+		uint32_t p = 0;
+
+		for (;;)
+		{
+			if (a & m)
+			{
+				p ^= b;
+				if ((a & (m - 1)) == 0)
+					break;
+			}
+
+			m >>= 1;
+			b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+		}
+
+		return p;
+	}
+
+	// CRC-32 of two pieces back to back, from the CRC-32 of each
+	uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, size_t length2)
+	{
+		// x^(8 * length2) by squaring, starting from x^8
+		uint32_t power = 1u << 23;
+		uint32_t result = 1u << 31;
+
+		for (size_t n = length2; n; n >>= 1)
+		{
+			if (n & 1)
+				result = crcMultiply(power, result);
+			power = crcMultiply(power, power);
+		}
+
+		return crcMultiply(result, crc1) ^ crc2;
+	}
+
+	// Filter for one row the way stb_image_write picks it: the smallest sum
+	// of the filtered bytes taken as signed, first one wins a tie
+	PngFilter pickFilter(const uint8_t *row, const uint8_t *prev, size_t length)
+	{
+		PngFilter best = PNG_FILTER_NONE;
+		uint32_t bestSum = UINT32_MAX;
+
+		for (int f = PNG_FILTER_NONE; f <= PNG_FILTER_PAETH; ++f)
+		{
+			uint32_t sum = 0;
+
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint8_t a = i >= 4 ? row[i - 4] : 0;
+				uint8_t b = prev[i];
+				uint8_t c = i >= 4 ? prev[i - 4] : 0;
+				uint8_t x = row[i];
+
+				switch (f)
+				{
+				case PNG_FILTER_SUB:   x -= a; break;
+				case PNG_FILTER_UP:    x -= b; break;
+				case PNG_FILTER_AVG:   x -= (a + b) >> 1; break;
+				case PNG_FILTER_PAETH: x -= paeth(a, b, c); break;
+				}
+
+				sum += abs((int8_t)x);
+			}
+
+			if (sum < bestSum)
+			{
+				bestSum = sum;
+				best = (PngFilter)f;
+			}
+		}
+
+		return best;
+	}
+
+	// A handful of threads that run batches of independent tasks. Whoever
+	// submits a batch works on it too, so several encoders can share the
+	// pool without waiting on each other.
+	class WorkerPool
+	{
+	public:
+		~WorkerPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+
+			wake.notify_all();
+
+			for (std::thread &thread : threads)
+				thread.join();
+		}
+
+		void start(unsigned count)
+		{
+			batches.reserve(64);
+
+			for (unsigned t = 0; t < count; ++t)
+				threads.emplace_back([this] { loop(); });
+		}
+
+		size_t size() const { return threads.size() + 1; }
+
+		// Calls fn(i) for every i below count, then returns
+		template <typename F>
+		void run(size_t count, F &fn)
+		{
+			Batch batch;
+			batch.count = count;
+			batch.context = &fn;
+			batch.task = [](void *context, size_t i) { (*static_cast<F*>(context))(i); };
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				batches.push_back(&batch);
+			}
+
+			wake.notify_all();
+			work(batch);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			batches.erase(std::find(batches.begin(), batches.end(), &batch));
+			finished.wait(lock, [&] { return batch.done == batch.count && batch.active == 0; });
+		}
+
+	private:
+		struct Batch
+		{
+			void (*task)(void *, size_t);
+			void *context;
+			size_t count;
+			std::atomic<size_t> next { 0 };
+			std::atomic<size_t> done { 0 };
+			// Pool threads inside work(), guarded by the mutex
+			unsigned active = 0;
+		};
+
+		void work(Batch &batch)
+		{
+			size_t i;
+
+			while ((i = batch.next++) < batch.count)
+			{
+				batch.task(batch.context, i);
+
+				if (++batch.done == batch.count)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					finished.notify_all();
+				}
+			}
+		}
+
+		void loop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			for (;;)
+			{
+				wake.wait(lock, [this] { return stopping || hasWork(); });
+
+				if (stopping)
+					return;
+
+				Batch *batch = nullptr;
+				for (Batch *b : batches)
+					if (b->next < b->count)
+						batch = b;
+
+				batch->active++;
+				lock.unlock();
+
+				work(*batch);
+
+				lock.lock();
+				batch->active--;
+				finished.notify_all();
+			}
+		}
+
+		bool hasWork() const
+		{
+			for (const Batch *b : batches)
+				if (b->next < b->count)
+					return true;
+			return false;
+		}
+
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable finished;
+		std::vector<Batch*> batches;
+		std::vector<std::thread> threads;
+		bool stopping = false;
+	};
+
+	WorkerPool workers;
+
+	// Raw data split into chunks of this size once an image has at least two
+	const size_t ChunkSize = 128 * 1024;
+}
+
+bool pngParsePreset(const char *name, PngPreset &preset)
+{
+	static const struct { const char *name; PngPreset preset; } presets[] =
+	{
+		{ "store",   PngPreset::Store },
+		{ "fast",    PngPreset::Fast },
+		{ "default", PngPreset::Default },
+		{ "max",     PngPreset::Max }
+	};
+
+	for (const auto &p : presets)
+	{
+		if (strcmp(name, p.name) == 0)
+		{
+			preset = p.preset;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void pngInit(PngPreset preset, unsigned threads)
+{
+	stbi_write_png_compression_level = preset == PngPreset::Max ? 64 : 8;
+
+	if (threads > 1)
+		workers.start(threads - 1);
+}
+
+unsigned char *pngEncode(const uint8_t *pixels, size_t width, size_t height, PngPreset preset, PngFilter filter, Arena &arena, size_t &size)
+{
+	size_t stride = 4 * width;
+	size_t rawSize = (stride + 1) * height;
+	bool parallel = workers.size() > 1 && rawSize >= 2 * ChunkSize && preset != PngPreset::Store;
+
+	if (!parallel && (preset == PngPreset::Default || preset == PngPreset::Max))
+	{
+		int length = 0;
+
+		stbArena = &arena;
+		unsigned char *png = stbi_write_png_to_mem(const_cast<uint8_t*>(pixels), stride, width, height, 4, &length);
+		stbArena = nullptr;
+
+		size = length;
+		return png;
+	}
+
+	// Filtered scanlines, each behind its filter type byte
+	uint8_t *raw = static_cast<uint8_t*>(arena.alloc(rawSize));
+	uint8_t *zero = static_cast<uint8_t*>(arena.alloc(stride));
+
+	memset(zero, 0, stride);
+
+	if (preset == PngPreset::Store)
+		filter = PNG_FILTER_NONE;
+
+	bool adaptive = preset == PngPreset::Default || preset == PngPreset::Max;
+	size_t rowsPerTask = parallel ? std::max<size_t>(1, ChunkSize / (stride + 1)) : height;
+
+	auto filterRows = [&](size_t task)
+	{
+		size_t last = std::min(height, (task + 1) * rowsPerTask);
+
+		for (size_t y = task * rowsPerTask; y < last; ++y)
+		{
+			const uint8_t *row = pixels + stride * y;
+			const uint8_t *prev = y ? row - stride : zero;
+			uint8_t *out = raw + (stride + 1) * y;
+			PngFilter f = adaptive ? pickFilter(row, prev, stride) : filter;
+
+			out[0] = f;
+			filterRow(f, row, prev, stride, out + 1);
+		}
+	};
+
+	if (parallel)
+		workers.run((height + rowsPerTask - 1) / rowsPerTask, filterRows);
+	else
+		filterRows(0);
+
+	// Deflate chunk by chunk, each into its own slot of the output
+	size_t chunks = parallel ? (rawSize + ChunkSize - 1) / ChunkSize : 1;
+	size_t chunkSize = parallel ? ChunkSize : rawSize;
+	size_t slotSize = preset == PngPreset::Store ? rawSize + 5 * (rawSize / 65535 + 1) : deflateBound(chunkSize);
+	unsigned maxChain = preset == PngPreset::Max ? 64 : preset == PngPreset::Default ? 8 : 1;
+
+	uint8_t *slots = static_cast<uint8_t*>(arena.alloc(chunks * slotSize));
+	size_t *lengths = static_cast<size_t*>(arena.alloc(chunks * sizeof(size_t)));
+	uint32_t *adlers = static_cast<uint32_t*>(arena.alloc(chunks * sizeof(uint32_t)));
+	uint32_t *crcs = static_cast<uint32_t*>(arena.alloc(chunks * sizeof(uint32_t)));
+
+	auto deflate = [&](size_t chunk)
+	{
+		size_t begin = chunk * chunkSize;
+		size_t end = std::min(rawSize, begin + chunkSize);
+		uint8_t *slot = slots + chunk * slotSize;
+		uint8_t *last;
+
+		if (preset == PngPreset::Store)
+			last = deflateStore(raw + begin, end - begin, slot);
+		else
+			last = deflateChunk(raw, begin, end, maxChain, chunk == chunks - 1, slot);
+
+		lengths[chunk] = last - slot;
+		adlers[chunk] = adler32(raw + begin, end - begin);
+		crcs[chunk] = crc32(0, slot, lengths[chunk]);
+	};
+
+	if (parallel)
+		workers.run(chunks, deflate);
+	else
+		deflate(0);
+
+	size_t zlibSize = 2 + 4;
+	for (size_t i = 0; i < chunks; ++i)
+		zlibSize += lengths[i];
+
+	// Signature, IHDR, IDAT, IEND
+	uint8_t *png = static_cast<uint8_t*>(arena.alloc(8 + 25 + 12 + zlibSize + 12));
+	uint8_t *o = png;
+
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	memcpy(o, signature, 8);
+	o += 8;
+
+	put32BE(o, 13);
+	memcpy(o + 4, "IHDR", 4);
+	put32BE(o + 8, width);
+	put32BE(o + 12, height);
+	o[16] = 8;  // bit depth
+	o[17] = 6;  // RGBA
+	o[18] = 0;
+	o[19] = 0;
+	o[20] = 0;
+	put32BE(o + 21, crc32(0, o + 4, 17));
+	o += 25;
+
+	put32BE(o, zlibSize);
+	memcpy(o + 4, "IDAT", 4);
+	o[8] = 0x78;
+	o[9] = 0x01;
+
+	uint32_t crc = crc32(0, o + 4, 6);
+	uint32_t adler = adlers[0];
+	uint8_t *data = o + 10;
+
+	for (size_t i = 0; i < chunks; ++i)
+	{
+		memcpy(data, slots + i * slotSize, lengths[i]);
+		data += lengths[i];
+
+		crc = crc32Combine(crc, crcs[i], lengths[i]);
+		if (i)
+			adler = adler32Combine(adler, adlers[i], std::min(chunkSize, rawSize - i * chunkSize));
+	}
+
+	put32BE(data, adler);
+	crc = crc32(crc, data, 4);
+	put32BE(data + 4, crc);
+	o = data + 8;
+
+	put32BE(o, 0);
+	memcpy(o + 4, "IEND", 4);
+	put32BE(o + 8, crc32(0, o + 4, 4));
+	o += 12;
+
+	size = o - png;
+	return png;
+}
@@ -0,0 +1,55 @@
+/*
+	PNG encoding for ilb2png
+*/
+
+#ifndef PNGENC_H
+#define PNGENC_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "arena.h"
+
+// Speed / size trade off of the encoder
+enum class PngPreset
+{
+	// No compression at all, stored deflate blocks
+	Store,
+	// One fixed filter and a greedy single probe deflate
+	Fast,
+	// stb_image_write as it always was: every filter tried per row
+	Default,
+	// Same with much longer hash chains
+	Max
+};
+
+// Row filters as numbered in the PNG spec
+enum PngFilter
+{
+	PNG_FILTER_NONE,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVG,
+	PNG_FILTER_PAETH
+};
+
+// Parses store, fast, default or max
+bool pngParsePreset(const char *name, PngPreset &preset);
+
+// Settles the stb compression level for the preset and, with more than one
+// thread, starts the threads that share the work on big images. Call once
+// before any encoding starts.
+void pngInit(PngPreset preset, unsigned threads = 1);
+
+// Encodes width x height RGBA pixels. filter is what Store and Fast use for
+// every row, Default and Max pick one per row. The PNG lives in arena until
+// it is next reset; nullptr if it can't be encoded.
+//
+// With encoder threads, images of 256K or more are filtered a band of rows
+// per task and deflated pigz style: 128K chunks each compressed on their
+// own, primed with the 32K before them and ended on a sync flush, then
+// joined with combined Adler-32 and CRC. Default and Max then compress with
+// the in-tree deflate instead of stb, so the output differs in size.
+unsigned char *pngEncode(const uint8_t *pixels, size_t width, size_t height, PngPreset preset, PngFilter filter, Arena &arena, size_t &size);
+
+#endif
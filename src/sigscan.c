@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "sigscan.h"
+
+/* how many bytes one step of the scan looks at */
+#define SCAN_BLOCK 16
+
+/* up to this many signatures each get their own look at every block, more
+   than that go through one automaton */
+#define SCAN_MAX_ANCHORED 4
+
+/* what the scan needs to know about one signature */
+typedef struct anchor
+{
+	const signature_t *sig;
+	/* offsets of the first and last bytes that aren't wildcards */
+	size_t first;
+	size_t last;
+} anchor_t;
+
+static bool match_list_push(match_list_t *list, size_t offset)
+{
+	if(list->count == list->capacity)
+	{
+		size_t capacity = list->capacity ? 2 * list->capacity : 16;
+		size_t *offsets = realloc(list->offsets, capacity * sizeof *offsets);
+
+		if(!offsets)
+			return false;
+
+		list->offsets = offsets;
+		list->capacity = capacity;
+	}
+
+	list->offsets[list->count++] = offset;
+	return true;
+}
+
+void match_list_free(match_list_t *list)
+{
+	free(list->offsets);
+	list->offsets = NULL;
+	list->count = list->capacity = 0;
+}
+
+static bool sig_verify(const uint8_t *at, const signature_t *sig)
+{
+	if(!sig->mask)
+		return memcmp(at, sig->bytes, sig->length) == 0;
+
+	for(size_t i = 0; i < sig->length; i++)
+		if(sig->mask[i] && at[i] != sig->bytes[i])
+			return false;
+
+	return true;
+}
+
+bool sig_parse(const char *text, uint8_t **bytes, uint8_t **mask, size_t *length)
+{
+	size_t capacity = strlen(text) / 2 + 1;
+	size_t count = 0;
+
+	*bytes = malloc(capacity);
+	*mask = malloc(capacity);
+	if(!*bytes || !*mask)
+		goto fail;
+
+	while(*text)
+	{
+		if(isspace((unsigned char)*text))
+		{
+			text++;
+			continue;
+		}
+
+		if(text[0] == '?')
+		{
+			(*bytes)[count] = 0;
+			(*mask)[count++] = 0;
+			text += text[1] == '?' ? 2 : 1;
+			continue;
+		}
+
+		if(!isxdigit((unsigned char)text[0]) || !isxdigit((unsigned char)text[1]))
+			goto fail;
+
+		char hex[3] = { text[0], text[1], 0 };
+		(*bytes)[count] = (uint8_t)strtoul(hex, NULL, 16);
+		(*mask)[count++] = 0xFF;
+		text += 2;
+	}
+
+	*length = count;
+	if(count == 0)
+		goto fail;
+	return true;
+
+fail:
+	free(*bytes);
+	free(*mask);
+	*bytes = *mask = NULL;
+	return false;
+}
+
+/* Aho-Corasick over the longest run of literal bytes of each signature,
+   built out into a full transition table so the scan is one lookup per
+   byte. Every keyword hit is checked against its whole signature. */
+typedef struct automaton
+{
+	int32_t (*next)[256];
+	int32_t *fail;
+	/* first signature whose keyword ends in a state, -1 if none */
+	int32_t *out;
+	/* nearest state down the fail chain with an output, -1 if none */
+	int32_t *dict;
+	size_t states;
+	/* next signature with the same keyword */
+	int32_t *same;
+	/* where each signature's keyword starts and how long it is */
+	size_t *key_start;
+	size_t *key_length;
+} automaton_t;
+
+static void automaton_free(automaton_t *ac)
+{
+	free(ac->next);
+	free(ac->fail);
+	free(ac->out);
+	free(ac->dict);
+	free(ac->same);
+	free(ac->key_start);
+	free(ac->key_length);
+}
+
+static bool automaton_build(automaton_t *ac, const signature_t *sigs, size_t sig_count)
+{
+	size_t capacity = 1;
+
+	memset(ac, 0, sizeof *ac);
+	ac->same = malloc(sig_count * sizeof *ac->same);
+	ac->key_start = malloc(sig_count * sizeof *ac->key_start);
+	ac->key_length = malloc(sig_count * sizeof *ac->key_length);
+	if(!ac->same || !ac->key_start || !ac->key_length)
+		return false;
+
+	/* longest run of literal bytes, the rarer the better but longest will do */
+	for(size_t s = 0; s < sig_count; s++)
+	{
+		size_t best = 0, best_length = 0;
+
+		for(size_t i = 0; i < sigs[s].length;)
+		{
+			size_t j = i;
+			while(j < sigs[s].length && (!sigs[s].mask || sigs[s].mask[j]))
+				j++;
+			if(j - i > best_length)
+			{
+				best = i;
+				best_length = j - i;
+			}
+			i = j + 1;
+		}
+
+		ac->key_start[s] = best;
+		ac->key_length[s] = best_length;
+		capacity += best_length;
+	}
+
+	ac->next = malloc(capacity * sizeof *ac->next);
+	ac->fail = calloc(capacity, sizeof *ac->fail);
+	ac->out = malloc(capacity * sizeof *ac->out);
+	ac->dict = malloc(capacity * sizeof *ac->dict);
+	if(!ac->next || !ac->fail || !ac->out || !ac->dict)
+		return false;
+
+	memset(ac->next[0], 0xFF, sizeof ac->next[0]);
+	ac->out[0] = ac->dict[0] = -1;
+	ac->states = 1;
+
+	/* the trie, outputs chained per state through same */
+	for(size_t s = 0; s < sig_count; s++)
+	{
+		const uint8_t *key = sigs[s].bytes + ac->key_start[s];
+		int32_t state = 0;
+
+		for(size_t i = 0; i < ac->key_length[s]; i++)
+		{
+			if(ac->next[state][key[i]] < 0)
+			{
+				int32_t fresh = ac->states++;
+				memset(ac->next[fresh], 0xFF, sizeof ac->next[fresh]);
+				ac->out[fresh] = ac->dict[fresh] = -1;
+				ac->next[state][key[i]] = fresh;
+			}
+			state = ac->next[state][key[i]];
+		}
+
+		ac->same[s] = ac->out[state];
+		ac->out[state] = s;
+	}
+
+	/* fail links breadth first, filling in every missing transition from
+	   the fail state, which is shallower and so already complete */
+	int32_t *queue = malloc(ac->states * sizeof *queue);
+	size_t head = 0, tail = 0;
+
+	if(!queue)
+		return false;
+
+	queue[tail++] = 0;
+	while(head < tail)
+	{
+		int32_t state = queue[head++];
+
+		for(int c = 0; c < 256; c++)
+		{
+			int32_t child = ac->next[state][c];
+
+			if(child < 0)
+			{
+				ac->next[state][c] = state ? ac->next[ac->fail[state]][c] : 0;
+				continue;
+			}
+
+			int32_t fail = state ? ac->next[ac->fail[state]][c] : 0;
+			ac->fail[child] = fail;
+			ac->dict[child] = ac->out[fail] >= 0 ? fail : ac->dict[fail];
+			queue[tail++] = child;
+		}
+	}
+
+	free(queue);
+	return true;
+}
+
+static bool scan_automaton(const uint8_t *data, size_t size, const signature_t *sigs, size_t sig_count, match_list_t *matches)
+{
+	automaton_t ac;
+	bool ok = automaton_build(&ac, sigs, sig_count);
+	int32_t state = 0;
+
+	for(size_t pos = 0; ok && pos < size; pos++)
+	{
+		state = ac.next[state][data[pos]];
+
+		for(int32_t hit = ac.out[state] >= 0 ? state : ac.dict[state]; hit >= 0; hit = ac.dict[hit])
+		{
+			for(int32_t s = ac.out[hit]; s >= 0; s = ac.same[s])
+			{
+				/* the keyword ended at pos, so the signature starts here */
+				size_t end = pos + 1 - ac.key_length[s];
+				if(end < ac.key_start[s])
+					continue;
+
+				size_t at = end - ac.key_start[s];
+				if(sigs[s].length > size - at)
+					continue;
+
+				if(sig_verify(data + at, &sigs[s]) && !match_list_push(&matches[s], at))
+					ok = false;
+			}
+		}
+	}
+
+	automaton_free(&ac);
+	return ok;
+}
+
+bool sig_scan(const uint8_t *data, size_t size, const signature_t *sigs, size_t sig_count, match_list_t *matches)
+{
+	anchor_t *anchors = calloc(sig_count ? sig_count : 1, sizeof *anchors);
+	bool ok = true;
+
+	if(!anchors)
+		return false;
+
+	/* a signature of nothing but wildcards would match everywhere */
+	for(size_t s = 0; s < sig_count; s++)
+	{
+		const signature_t *sig = &sigs[s];
+		size_t first = 0;
+		size_t last = sig->length;
+
+		while(first < sig->length && sig->mask && !sig->mask[first])
+			first++;
+		while(last > first && sig->mask && !sig->mask[last - 1])
+			last--;
+
+		if(first == sig->length)
+		{
+			free(anchors);
+			return false;
+		}
+
+		if(sig_count > SCAN_MAX_ANCHORED)
+			continue;
+
+		anchors[s].sig = sig;
+		anchors[s].first = first;
+		anchors[s].last = last - 1;
+	}
+
+	if(sig_count > SCAN_MAX_ANCHORED)
+	{
+		free(anchors);
+		return scan_automaton(data, size, sigs, sig_count, matches);
+	}
+
+	/* every signature looks at the same block of data before the scan
+	   moves on, so the file is read once however many there are */
+	size_t pos = 0;
+
+#ifdef __SSE2__
+	size_t longest = 0;
+	for(size_t s = 0; s < sig_count; s++)
+		if(sigs[s].length > longest)
+			longest = sigs[s].length;
+
+	/* candidates are offsets whose first and last anchor bytes both match,
+	   16 offsets at a time, and only those get compared in full */
+	for(; ok && longest <= size && pos + SCAN_BLOCK <= size - longest + 1; pos += SCAN_BLOCK)
+	{
+		for(size_t s = 0; s < sig_count; s++)
+		{
+			const anchor_t *a = &anchors[s];
+			__m128i first = _mm_loadu_si128((const __m128i*)(data + pos + a->first));
+			__m128i last = _mm_loadu_si128((const __m128i*)(data + pos + a->last));
+			__m128i hit = _mm_and_si128(
+				_mm_cmpeq_epi8(first, _mm_set1_epi8((char)a->sig->bytes[a->first])),
+				_mm_cmpeq_epi8(last, _mm_set1_epi8((char)a->sig->bytes[a->last])));
+			unsigned bits = (unsigned)_mm_movemask_epi8(hit);
+
+			while(bits)
+			{
+				size_t at = pos + __builtin_ctz(bits);
+				bits &= bits - 1;
+
+				if(sig_verify(data + at, a->sig) && !match_list_push(&matches[s], at))
+					ok = false;
+			}
+		}
+	}
+#endif
+
+	/* whatever is left, one offset at a time */
+	for(; ok && pos < size; pos++)
+	{
+		for(size_t s = 0; s < sig_count; s++)
+		{
+			const anchor_t *a = &anchors[s];
+
+			if(a->sig->length > size - pos)
+				continue;
+
+			if(data[pos + a->first] == a->sig->bytes[a->first] && sig_verify(data + pos, a->sig) && !match_list_push(&matches[s], pos))
+				ok = false;
+		}
+	}
+
+	free(anchors);
+	return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef _SIGSCAN_H
+#define _SIGSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* byte signature, mask[i] == 0 makes byte i a wildcard */
+typedef struct signature
+{
+	const uint8_t *bytes;
+	/* NULL if every byte counts */
+	const uint8_t *mask;
+	size_t length;
+} signature_t;
+
+/* growable list of match offsets */
+typedef struct match_list
+{
+	size_t *offsets;
+	size_t count;
+	size_t capacity;
+} match_list_t;
+
+/* parse a signature like "66 8B ?? 8D", bytes and mask get length entries
+   and are malloc'd */
+bool sig_parse(const char *text, uint8_t **bytes, uint8_t **mask, size_t *length);
+
+/* find every offset at which one of sigs matches, overlapping and unaligned
+   ones included, in a single pass over data; matches[i] collects the
+   offsets of sigs[i] in ascending order; a few signatures are checked
+   with SIMD directly, more go through one Aho-Corasick automaton */
+bool sig_scan(const uint8_t *data, size_t size, const signature_t *sigs, size_t sig_count, match_list_t *matches);
+
+void match_list_free(match_list_t *list);
+
+#endif
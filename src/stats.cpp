@@ -0,0 +1,180 @@
+/*
+	Per image timing and counters for ilb2png --stats
+*/
+
+#include "stats.h"
+#include "imgenc.h"
+
+#include <cstdio>
+#include <cstring>
+
+bool parseStatsFormat(const char *name, StatsFormat &format, std::string &file)
+{
+	if (strcmp(name, "text") == 0)
+		format = StatsFormat::Text;
+	else if (strcmp(name, "json") == 0)
+		format = StatsFormat::Json;
+	else if (strncmp(name, "json:", 5) == 0 && name[5])
+	{
+		format = StatsFormat::Json;
+		file = name + 5;
+	}
+	else
+		return false;
+
+	return true;
+}
+
+void ImageStats::add(const ImageStats &other)
+{
+	parseNs += other.parseNs;
+	readNs += other.readNs;
+	translateNs += other.translateNs;
+	translateCalls += other.translateCalls;
+	compositeNs += other.compositeNs;
+	compositeCalls += other.compositeCalls;
+	fusedLayers += other.fusedLayers;
+	encodeNs += other.encodeNs;
+	writeNs += other.writeNs;
+
+	bytesRead += other.bytesRead;
+	pixels += other.pixels;
+	transparent += other.transparent;
+	opaque += other.opaque;
+	translucent += other.translucent;
+	outputBytes += other.outputBytes;
+}
+
+void ImageStats::countAlpha(const Image &image)
+{
+	size_t count = image.width * image.height;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint8_t a = image.data[4 * i + 3];
+
+		if (a == 0)
+			transparent++;
+		else if (a == 255)
+			opaque++;
+	}
+
+	translucent += count - transparent - opaque;
+}
+
+RunStats::RunStats(size_t images)
+{
+	// Taken up front so collecting doesn't show up in the allocation count
+	entries.reserve(images);
+}
+
+void RunStats::add(const std::string &source, uint32_t id, const ImageStats &stats)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	entries.push_back({ &source, id, stats });
+	total.add(stats);
+}
+
+namespace
+{
+	// The fields of ImageStats in report order
+	const struct { const char *name; uint64_t ImageStats::*field; bool time; } fields[] =
+	{
+		{ "parse",          &ImageStats::parseNs,        true },
+		{ "read",           &ImageStats::readNs,         true },
+		{ "translate",      &ImageStats::translateNs,    true },
+		{ "translateCalls", &ImageStats::translateCalls, false },
+		{ "composite",      &ImageStats::compositeNs,    true },
+		{ "compositeCalls", &ImageStats::compositeCalls, false },
+		{ "fusedLayers",    &ImageStats::fusedLayers,    false },
+		{ "encode",         &ImageStats::encodeNs,       true },
+		{ "write",          &ImageStats::writeNs,        true },
+		{ "bytesRead",      &ImageStats::bytesRead,      false },
+		{ "pixels",         &ImageStats::pixels,         false },
+		{ "transparent",    &ImageStats::transparent,    false },
+		{ "opaque",         &ImageStats::opaque,         false },
+		{ "translucent",    &ImageStats::translucent,    false },
+		{ "outputBytes",    &ImageStats::outputBytes,    false }
+	};
+
+	// Times go out in seconds
+	void appendFields(std::string &out, const ImageStats &stats)
+	{
+		char value[64];
+
+		for (const auto &f : fields)
+		{
+			if (f.time)
+				snprintf(value, sizeof value, ", \"%s\": %.9f", f.name, stats.*f.field / 1e9);
+			else
+				snprintf(value, sizeof value, ", \"%s\": %llu", f.name, (unsigned long long)(stats.*f.field));
+			out += value;
+		}
+	}
+
+	void textLine(std::ostream &out, const char *label, const ImageStats &s)
+	{
+		char line[256];
+		snprintf(line, sizeof line, "%-10s %8.3f %8.3f %9.3f %9.3f %8.3f %8.3f %11llu %11llu %6.1f%% %11llu",
+			label, s.parseNs / 1e6, s.readNs / 1e6, s.translateNs / 1e6, s.compositeNs / 1e6, s.encodeNs / 1e6, s.writeNs / 1e6,
+			(unsigned long long)s.bytesRead, (unsigned long long)s.pixels,
+			s.transparent + s.opaque + s.translucent ? 100.0 * s.transparent / (s.transparent + s.opaque + s.translucent) : 0.0,
+			(unsigned long long)s.outputBytes);
+		out << line << std::endl;
+	}
+}
+
+void RunStats::report(std::ostream &out, StatsFormat format, const std::vector<const StageStats*> &stages) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (format == StatsFormat::Text)
+	{
+		out << "Image      parse(ms) read(ms) trans(ms)  comp(ms)  enc(ms) write(ms)  bytes read      pixels  clear     written" << std::endl;
+
+		for (const Entry &entry : entries)
+		{
+			char label[16];
+			snprintf(label, sizeof label, "%u", entry.id);
+			textLine(out, label, entry.stats);
+		}
+
+		textLine(out, "total", total);
+		return;
+	}
+
+	std::string json = "{\n\"stages\": [";
+	char line[256];
+
+	for (size_t i = 0; i < stages.size(); ++i)
+	{
+		const StageStats &s = *stages[i];
+
+		snprintf(line, sizeof line, "%s\n\t{ \"name\": \"%s\", \"threads\": %u, \"items\": %llu, \"busy\": %.9f, \"starved\": %.9f, \"starvedWaits\": %llu, \"stalled\": %.9f, \"stalledWaits\": %llu }",
+			i ? "," : "", s.name, s.threads, (unsigned long long)s.items.load(), s.busyNs / 1e9,
+			s.inputWaitNs / 1e9, (unsigned long long)s.inputWaits.load(),
+			s.outputWaitNs / 1e9, (unsigned long long)s.outputWaits.load());
+		json += line;
+	}
+
+	json += "\n],\n\"images\": [";
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const Entry &entry = entries[i];
+
+		json += i ? ",\n\t{ \"source\": " : "\n\t{ \"source\": ";
+		appendJsonString(json, *entry.source);
+		snprintf(line, sizeof line, ", \"id\": %u", entry.id);
+		json += line;
+		appendFields(json, entry.stats);
+		json += " }";
+	}
+
+	json += "\n],\n\"total\": { \"images\": " + std::to_string(entries.size());
+	appendFields(json, total);
+	json += " }\n}\n";
+
+	out << json;
+}
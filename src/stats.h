@@ -0,0 +1,106 @@
+/*
+	Per image timing and counters for ilb2png --stats
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+#include "decode.h"
+
+// Parses text, json or json:FILE
+bool parseStatsFormat(const char *name, StatsFormat &format, std::string &file);
+
+// Where one image's time went and how much it moved, filled in as it goes
+// through the pipeline. Times are in nanoseconds.
+struct ImageStats
+{
+	// Reading the record headers of every layer
+	uint64_t parseNs;
+	// Faulting the layers' pixel data in from the mapping
+	uint64_t readNs;
+	// Layers decoded into a canvas of their own
+	uint64_t translateNs;
+	uint64_t translateCalls;
+	// Layers blended onto the image, either afterwards by Image::composite
+	// or fused into decoding them by translateOver. A fused layer's time is
+	// all composite, its blend can't be timed apart from its decode.
+	uint64_t compositeNs;
+	uint64_t compositeCalls;
+	// How many of the composite calls were fused
+	uint64_t fusedLayers;
+	uint64_t encodeNs;
+	uint64_t writeNs;
+
+	// Record headers and pixel data
+	uint64_t bytesRead;
+	// Decoded pixels over all layers
+	uint64_t pixels;
+	// Pixels of the finished canvas by alpha: 0, 255 and everything between
+	uint64_t transparent;
+	uint64_t opaque;
+	uint64_t translucent;
+	uint64_t outputBytes;
+
+	void reset() { *this = ImageStats(); }
+	void add(const ImageStats &other);
+
+	// Counts the alpha values of a finished canvas
+	void countAlpha(const Image &image);
+};
+
+// Adds the time until it goes out of scope to counter. Without a counter it
+// doesn't even read the clock, so leaving stats off costs a branch.
+class StatTimer
+{
+public:
+	explicit StatTimer(uint64_t *counter) : counter(counter), start(counter ? pipelineNow() : 0) {}
+
+	~StatTimer()
+	{
+		if (counter)
+			*counter += pipelineNow() - start;
+	}
+
+	StatTimer(const StatTimer &) = delete;
+	StatTimer &operator=(const StatTimer &) = delete;
+
+private:
+	uint64_t *counter;
+	uint64_t start;
+};
+
+// Every image of a run and their sum, for the report at exit
+class RunStats
+{
+public:
+	explicit RunStats(size_t images);
+
+	// Thread safe
+	void add(const std::string &source, uint32_t id, const ImageStats &stats);
+
+	// The stages, then every image and the total, as a table or one JSON
+	// object
+	void report(std::ostream &out, StatsFormat format, const std::vector<const StageStats*> &stages) const;
+
+private:
+	struct Entry
+	{
+		const std::string *source;
+		uint32_t id;
+		ImageStats stats;
+	};
+
+	mutable std::mutex mutex;
+	std::vector<Entry> entries;
+	ImageStats total = {};
+};
+
+#endif
@@ -27,6 +27,9 @@ BUILDING:
    malloc,realloc,free.
    You can define STBIW_MEMMOVE() to replace memmove()
 
+   PNG compression level (the hash chain length, default 8) can be set with
+   stbi_write_png_compression_level.
+
 USAGE:
 
    There are four functions, one for each image file format:
@@ -124,6 +127,7 @@ extern "C" {
 #else
 #define STBIWDEF extern
 extern int stbi_write_tga_with_rle;
+extern int stbi_write_png_compression_level;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -140,6 +144,8 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 
+STBIWDEF unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_in_bytes, int w, int h, int comp, int *out_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -236,8 +242,10 @@ typedef int stb_image_write_test[sizeof(stbiw_uint32)==4 ? 1 : -1];
 
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_tga_with_rle = 1;
+static int stbi_write_png_compression_level = 8;
 #else
 int stbi_write_tga_with_rle = 1;
+int stbi_write_png_compression_level = 8;
 #endif
 
 static void stbiw__writefv(stbi__write_context *s, const char *fmt, va_list v)
@@ -950,7 +958,7 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
+   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level); // increase to get smaller but use more memory
    STBIW_FREE(filt);
    if (!zlib) return 0;
 
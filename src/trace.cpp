@@ -0,0 +1,66 @@
+/*
+	Chrome trace event timeline for ilb2png --trace
+*/
+
+#include "trace.h"
+#include "output.h"
+
+#include <cstdio>
+
+thread_local TraceBuffer *traceBuffer = nullptr;
+
+Tracer::Tracer() : start(pipelineNow())
+{
+}
+
+void Tracer::attach(const char *name, unsigned index)
+{
+	auto buffer = std::make_unique<TraceBuffer>();
+
+	buffer->name = name;
+	buffer->index = index;
+	// A few thousand images before the buffer first has to grow
+	buffer->events.reserve(4096);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	buffer->tid = buffers.size() + 1;
+	traceBuffer = buffer.get();
+	buffers.push_back(std::move(buffer));
+}
+
+bool Tracer::write(const char *filename, std::string &error) const
+{
+	std::string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	char line[192];
+
+	snprintf(line, sizeof line, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"ilb2png\"}}");
+	json += line;
+
+	for (const std::unique_ptr<TraceBuffer> &buffer : buffers)
+	{
+		snprintf(line, sizeof line, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s %u\"}}",
+			buffer->tid, buffer->name, buffer->index);
+		json += line;
+
+		// Spans end in the order they close, so an enclosing step comes
+		// after the steps inside it. Begin and end events have to nest in
+		// time order, hence complete events, which need no ordering.
+		for (const TraceEvent &event : buffer->events)
+		{
+			snprintf(line, sizeof line, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"id\": %u}}",
+				event.name, buffer->tid, (event.begin - start) / 1e3, (event.end - event.begin) / 1e3, event.id);
+			json += line;
+		}
+	}
+
+	json += "\n]}\n";
+
+	if (!writeFile(filename, reinterpret_cast<const unsigned char*>(json.data()), json.size()))
+	{
+		error = std::string("Failed to write trace ") + filename;
+		return false;
+	}
+
+	return true;
+}
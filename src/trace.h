@@ -0,0 +1,82 @@
+/*
+	Chrome trace event timeline for ilb2png --trace
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+// One step of one image on one thread
+struct TraceEvent
+{
+	// A string literal
+	const char *name;
+	uint32_t id;
+	uint64_t begin;
+	uint64_t end;
+};
+
+// The events of one thread. Only that thread ever appends to it, so
+// recording takes no lock; the buffers are read once every thread is done.
+struct TraceBuffer
+{
+	const char *name;
+	unsigned index;
+	unsigned tid;
+	std::vector<TraceEvent> events;
+};
+
+class Tracer
+{
+public:
+	Tracer();
+
+	// Gives the calling thread its own buffer; its spans go there from now
+	// on. name and index become the thread's name in the viewer.
+	void attach(const char *name, unsigned index = 0);
+
+	// Writes all events as Chrome trace JSON, which chrome://tracing and
+	// Perfetto open as is
+	bool write(const char *filename, std::string &error) const;
+
+private:
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TraceBuffer>> buffers;
+	uint64_t start;
+};
+
+// Buffer of the calling thread, nullptr if it isn't traced
+extern thread_local TraceBuffer *traceBuffer;
+
+// Records the time from construction to destruction as a step of image id,
+// if the thread is traced. Otherwise it is a branch and nothing more.
+class TraceSpan
+{
+public:
+	TraceSpan(const char *name, uint32_t id) : buffer(traceBuffer), name(name), id(id), begin(buffer ? pipelineNow() : 0) {}
+
+	~TraceSpan()
+	{
+		if (buffer)
+			buffer->events.push_back({ name, id, begin, pipelineNow() });
+	}
+
+	TraceSpan(const TraceSpan &) = delete;
+	TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+	TraceBuffer *buffer;
+	const char *name;
+	uint32_t id;
+	uint64_t begin;
+};
+
+#endif
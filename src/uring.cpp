@@ -0,0 +1,261 @@
+/*
+	io_uring file writer for ilb2png
+*/
+
+#include "uring.h"
+#include "output.h"
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace
+{
+	// What each completion of a file's chain was, in the low bits of
+	// user_data; the slot is above
+	enum Step
+	{
+		STEP_OPEN,
+		STEP_WRITE,
+		STEP_CLOSE
+	};
+
+	// One write covers a file up to here; bigger ones are written the plain
+	// way, len is only 32 bits and short writes would break the chain anyway
+	const size_t MaxRingWrite = 1 << 30;
+
+	int ioUringSetup(unsigned entries, struct io_uring_params *params)
+	{
+		return syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int ioUringEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+	{
+		return syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+	}
+
+	int ioUringRegister(int fd, unsigned opcode, const void *arg, unsigned count)
+	{
+		return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+	}
+
+	template <typename T>
+	T *at(void *base, uint32_t offset)
+	{
+		return reinterpret_cast<T*>(static_cast<uint8_t*>(base) + offset);
+	}
+}
+
+UringWriter::~UringWriter()
+{
+	// Anything still pending belongs to buffers that are about to go away,
+	// so wait it out
+	std::vector<std::pair<void*, bool>> done;
+	while (fd >= 0 && pending() && reap(done, true))
+		done.clear();
+
+	close();
+}
+
+void UringWriter::close()
+{
+	if (sqeMap)
+		munmap(sqeMap, sqeSize);
+	if (ring)
+		munmap(ring, ringSize);
+	if (fd >= 0)
+		::close(fd);
+
+	sqeMap = ring = nullptr;
+	fd = -1;
+	unsubmitted = 0;
+	slots.clear();
+	freeSlots.clear();
+	ready.clear();
+}
+
+bool UringWriter::open(unsigned depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+
+	fd = ioUringSetup(3 * depth, &params);
+	if (fd < 0)
+		return false;
+
+	// Opening into a fixed file slot came with 5.15, skipping completions
+	// with 5.17, which is the closest thing to a version check there is.
+	// One mapping for both rings came with 5.4.
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_CQE_SKIP))
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+
+	ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	sqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqeMap = mmap(nullptr, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (ring == MAP_FAILED || sqeMap == MAP_FAILED)
+	{
+		if (ring == MAP_FAILED)
+			ring = nullptr;
+		if (sqeMap == MAP_FAILED)
+			sqeMap = nullptr;
+		return false;
+	}
+
+	sqHead = at<unsigned>(ring, params.sq_off.head);
+	sqTail = at<unsigned>(ring, params.sq_off.tail);
+	sqMask = *at<unsigned>(ring, params.sq_off.ring_mask);
+	sqArray = at<unsigned>(ring, params.sq_off.array);
+	sqes = static_cast<struct io_uring_sqe*>(sqeMap);
+	cqHead = at<unsigned>(ring, params.cq_off.head);
+	cqTail = at<unsigned>(ring, params.cq_off.tail);
+	cqMask = *at<unsigned>(ring, params.cq_off.ring_mask);
+	cqes = at<struct io_uring_cqe>(ring, params.cq_off.cqes);
+
+	// Empty fixed file table, one entry per slot
+	std::vector<int> files(depth, -1);
+	if (ioUringRegister(fd, IORING_REGISTER_FILES, files.data(), depth) < 0)
+		return false;
+
+	slots.resize(depth);
+	for (unsigned i = depth; i > 0; --i)
+		freeSlots.push_back(i - 1);
+
+	ready.reserve(depth);
+
+	return true;
+}
+
+void UringWriter::submit(int dirfd, const char *path, const unsigned char *data, size_t size, void *tag)
+{
+	unsigned index = freeSlots.back();
+	freeSlots.pop_back();
+
+	slots[index] = { tag, dirfd, path, data, size, 3, false };
+
+	if (size > MaxRingWrite)
+	{
+		slots[index].failed = true;
+		slots[index].remaining = 0;
+		finish(index, ready);
+		return;
+	}
+
+	// Only this thread writes the tail, the kernel only reads it
+	unsigned tail = *sqTail;
+
+	for (unsigned step = STEP_OPEN; step <= STEP_CLOSE; ++step)
+	{
+		struct io_uring_sqe *sqe = &sqes[tail & sqMask];
+		memset(sqe, 0, sizeof *sqe);
+		sqe->user_data = (uint64_t)index << 2 | step;
+
+		switch (step)
+		{
+		case STEP_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = dirfd;
+			sqe->addr = (uintptr_t)path;
+			sqe->len = 0666;
+			sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+			sqe->file_index = index + 1;
+			sqe->flags = IOSQE_IO_LINK;
+			break;
+		case STEP_WRITE:
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = index;
+			sqe->addr = (uintptr_t)data;
+			sqe->len = size;
+			sqe->off = 0;
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			break;
+		case STEP_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = index + 1;
+			break;
+		}
+
+		sqArray[tail & sqMask] = tail & sqMask;
+		tail++;
+	}
+
+	__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+	unsubmitted += 3;
+}
+
+bool UringWriter::reap(std::vector<std::pair<void*, bool>> &done, bool wait)
+{
+	if (!ready.empty())
+	{
+		done.insert(done.end(), ready.begin(), ready.end());
+		ready.clear();
+		wait = false;
+	}
+
+	while (pending() || unsubmitted)
+	{
+		// Hand over everything queued and, if asked to, sleep until
+		// something completes
+		bool sleep = wait && pending();
+		int result = ioUringEnter(fd, unsubmitted, sleep ? 1 : 0, sleep ? IORING_ENTER_GETEVENTS : 0);
+
+		if (result >= 0)
+			unsubmitted -= std::min<unsigned>(result, unsubmitted);
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return false;
+
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		bool any = head != tail;
+
+		for (; head != tail; ++head)
+		{
+			const struct io_uring_cqe &cqe = cqes[head & cqMask];
+			unsigned index = cqe.user_data >> 2;
+			Slot &slot = slots[index];
+
+			switch (cqe.user_data & 3)
+			{
+			case STEP_OPEN:
+			case STEP_CLOSE:
+				if (cqe.res < 0)
+					slot.failed = true;
+				break;
+			case STEP_WRITE:
+				if (cqe.res != (int)slot.size)
+					slot.failed = true;
+				break;
+			}
+
+			if (--slot.remaining == 0)
+				finish(index, done);
+		}
+
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+		// Go round again for whatever the kernel didn't take yet, or a
+		// wait that woke up for nothing
+		if (result >= 0 && !unsubmitted && (any || !sleep))
+			break;
+	}
+
+	return true;
+}
+
+void UringWriter::finish(size_t index, std::vector<std::pair<void*, bool>> &done)
+{
+	Slot &slot = slots[index];
+	bool ok = !slot.failed || writeFileAt(slot.dirfd, slot.path, slot.data, slot.size);
+
+	done.emplace_back(slot.tag, ok);
+	freeSlots.push_back(index);
+}
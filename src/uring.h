@@ -0,0 +1,89 @@
+/*
+	io_uring file writer for ilb2png
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Writes whole files into directories without waiting on any of them. Every
+// file is an openat, a write and a close linked together in one go, into a
+// fixed file slot so the fd never reaches the process, and submissions are
+// batched until the next reap. Needs Linux 5.17 or later; without it open
+// fails and the caller writes files itself.
+class UringWriter
+{
+public:
+	UringWriter() = default;
+	~UringWriter();
+
+	UringWriter(const UringWriter &) = delete;
+	UringWriter &operator=(const UringWriter &) = delete;
+
+	// Sets up a ring for depth files at once
+	bool open(unsigned depth);
+
+	// Tears the ring down without waiting for what is pending, after reap
+	// failed. Files that were pending are never reported.
+	void close();
+
+	bool full() const { return freeSlots.empty(); }
+	size_t pending() const { return slots.size() - freeSlots.size(); }
+
+	// Queues the file path relative to dirfd. path and data have to stay
+	// untouched until the file comes back from reap. Not while full.
+	void submit(int dirfd, const char *path, const unsigned char *data, size_t size, void *tag);
+
+	// Submits what is queued and appends the tag of every finished file to
+	// done, with whether it was written. A file whose chain failed is
+	// written again the plain way before it is reported. With wait, blocks
+	// until at least one file is done, if any are pending. False if the
+	// ring itself failed.
+	bool reap(std::vector<std::pair<void*, bool>> &done, bool wait);
+
+private:
+	struct Slot
+	{
+		void *tag;
+		int dirfd;
+		const char *path;
+		const unsigned char *data;
+		size_t size;
+		// Completions still to come
+		unsigned remaining;
+		bool failed;
+	};
+
+	void finish(size_t index, std::vector<std::pair<void*, bool>> &done);
+
+	int fd = -1;
+	void *ring = nullptr;
+	size_t ringSize = 0;
+	void *sqeMap = nullptr;
+	size_t sqeSize = 0;
+
+	// Views into the ring
+	unsigned *sqHead = nullptr;
+	unsigned *sqTail = nullptr;
+	unsigned sqMask = 0;
+	unsigned *sqArray = nullptr;
+	struct io_uring_sqe *sqes = nullptr;
+	unsigned *cqHead = nullptr;
+	unsigned *cqTail = nullptr;
+	unsigned cqMask = 0;
+	struct io_uring_cqe *cqes = nullptr;
+
+	// Written to the ring but not yet handed to the kernel
+	unsigned unsubmitted = 0;
+
+	std::vector<Slot> slots;
+	std::vector<unsigned> freeSlots;
+	// Files done without the ring, reported on the next reap
+	std::vector<std::pair<void*, bool>> ready;
+};
+
+#endif